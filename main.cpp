@@ -3,15 +3,154 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <queue>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <climits>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 //
 // Some useful global definitions
 //
+// Values exchanged by the processes are small integer handles. The handles below
+// FIRST_INTERNED are the classic single character values, so binary agreement works
+// just as it always has. Anything else - a 64-bit transaction ID, a batch hash -
+// is interned in the ValueTable below, and the handle refers to it.
+//
 typedef std::string Path;
-const char ONE = '1';
-const char ZERO = '0';
-const char UNKNOWN = '?';
-const char FAULTY = 'X';
+typedef uint32_t Value;
+const Value ONE = '1';
+const Value ZERO = '0';
+const Value UNKNOWN = '?';
+const Value FAULTY = 'X';
+const Value FIRST_INTERNED = 256;
+
+//
+// The ValueTable keeps the payloads of multi-valued agreement out of line. Each
+// distinct payload is stored exactly once, so nodes only carry a four byte handle
+// and comparing two values, which is what the majority vote does all day long,
+// is an integer compare no matter how big the payload is.
+//
+// A payload can also be a vector of bits, which is how vector consensus agrees on
+// a whole batch of independent flags at once. Bit vectors are packed into 64-bit
+// words, and remember how many of the bits are in use.
+//
+class ValueTable {
+public :
+    static Value Intern( const std::string &payload, size_t bits = 0 )
+    {
+        std::pair<size_t, std::string> key( bits, payload );
+        std::map<std::pair<size_t, std::string>, Value>::iterator ii = mIndex.find( key );
+        if ( ii != mIndex.end() )
+            return ii->second;
+        Value value = FIRST_INTERNED + (Value) mPayloads.size();
+        mPayloads.push_back( payload );
+        mBits.push_back( bits );
+        mIndex[ key ] = value;
+        return value;
+    }
+    //
+    // 64-bit IDs are stored big-endian, so that they print the way you'd expect.
+    //
+    static Value Intern( uint64_t id )
+    {
+        std::string payload( 8, '\0' );
+        for ( int i = 7 ; i >= 0 ; i-- ) {
+            payload[ i ] = static_cast<char>( id & 0xff );
+            id >>= 8;
+        }
+        return Intern( payload );
+    }
+    //
+    // Bits past the end of the vector are cleared, so that equal vectors always
+    // intern to the same value.
+    //
+    static Value InternBits( std::vector<uint64_t> words, size_t bits )
+    {
+        words.resize( ( bits + 63 ) / 64 );
+        if ( bits % 64 )
+            words.back() &= ( (uint64_t) 1 << ( bits % 64 ) ) - 1;
+        std::string payload( words.size() * sizeof( uint64_t ), '\0' );
+        if ( words.size() )
+            memcpy( &payload[ 0 ], &words[ 0 ], payload.size() );
+        return Intern( payload, bits );
+    }
+    static const std::string &Payload( Value value )
+    {
+        return mPayloads[ value - FIRST_INTERNED ];
+    }
+    //
+    // The number of payloads interned so far
+    //
+    static size_t Size()
+    {
+        return mPayloads.size();
+    }
+    //
+    // The number of bits in a bit vector value, or zero for anything else.
+    //
+    static size_t Bits( Value value )
+    {
+        return value < FIRST_INTERNED ? 0 : mBits[ value - FIRST_INTERNED ];
+    }
+    static uint64_t Word( Value value, size_t i )
+    {
+        uint64_t word;
+        memcpy( &word, Payload( value ).data() + i * sizeof( uint64_t ), sizeof( uint64_t ) );
+        return word;
+    }
+    //
+    // A proper value is one that a loyal process could legitimately have sent.
+    //
+    static bool IsProper( Value value )
+    {
+        return value == ONE || value == ZERO || value >= FIRST_INTERNED;
+    }
+    //
+    // The printable form of a value: the character itself for the classic values,
+    // or a hex dump of the payload for interned ones.
+    //
+    static std::string Format( Value value )
+    {
+        if ( value < FIRST_INTERNED )
+            return std::string( 1, static_cast<char>( value ) );
+        if ( Bits( value ) ) {
+            std::string s;
+            for ( size_t i = 0 ; i < Bits( value ) ; i++ )
+                s += ( ( Word( value, i / 64 ) >> ( i % 64 ) ) & 1 ) ? '1' : '0';
+            return s;
+        }
+        static const char digits[] = "0123456789abcdef";
+        const std::string &payload = Payload( value );
+        std::string s = "#";
+        for ( size_t i = 0 ; i < payload.size() ; i++ ) {
+            s += digits[ ( payload[ i ] >> 4 ) & 0xf ];
+            s += digits[ payload[ i ] & 0xf ];
+        }
+        return s;
+    }
+private :
+    static std::vector<std::string> mPayloads;
+    static std::vector<size_t> mBits;
+    static std::map<std::pair<size_t, std::string>, Value> mIndex;
+};
 
 //
 // Each process has a map of nodes, with the index to the map being
@@ -25,12 +164,12 @@ const char FAULTY = 'X';
 // in a map
 //
 struct Node {
-    Node( char input = FAULTY, char output = FAULTY )
+    Node( Value input = FAULTY, Value output = FAULTY )
         : input_value( input )
         , output_value( output )
     {};
-    char input_value;
-    char output_value;
+    Value input_value;
+    Value output_value;
 };
 
 
@@ -54,14 +193,33 @@ struct Node {
 // or a zero to all processes, whereas process 2 sends a one to everyone,
 // regardless of what it is supposed to send
 //
+// For multi-valued agreement the same scenario is played out with two 64-bit
+// batch IDs standing in for zero and one. For vector consensus, zero is a
+// batch of flags, and one is the same batch with every flag flipped.
+//
 
 class Traits {
 public :
-    Traits( int source, int m, int n, bool debug = false )
+    //
+    // The ways process 2 can misbehave in a round. LIE is the stock behavior.
+    //
+    enum Strategy {
+        LIE,        // always send ONE
+        ECHO,       // behave, relaying what it was told
+        INVERT,     // relay the opposite of what it was told
+        SPLIT       // tell odd processes ZERO and even ones ONE, like the source
+    };
+    Traits( int source, int m, int n, bool debug = false, bool multi_valued = false, size_t bits = 0 )
         : mSource( source )
         , mM( m )
         , mN( n )
         , mDebug( debug )
+        , mBits( bits )
+        , mZero( bits ? Flags( bits, false )
+                      : multi_valued ? ValueTable::Intern( ( (uint64_t) 0x5eedc0deu << 32 ) | 0xa ) : ZERO )
+        , mOne( bits ? Flags( bits, true )
+                     : multi_valued ? ValueTable::Intern( ( (uint64_t) 0x5eedc0deu << 32 ) | 0xb ) : ONE )
+        , mStrategies( m + 1, LIE )
     {}
     //
     // This method returns the true value of the source's value. The source may send
@@ -73,7 +231,16 @@ public :
     // matter.
     //
     Node GetSourceValue() {
-        return Node( ZERO, UNKNOWN );
+        return Node( mZero, UNKNOWN );
+    }
+    //
+    // With interactive consistency, every general is a source with a value of its
+    // own. Here the odd ones want mOne and the even ones mZero, so that the vector
+    // the loyal processes agree on has some of each.
+    //
+    Value GetProposal( int process )
+    {
+        return (process & 1) ? mOne : mZero;
     }
     //
     // During message, GetValue() is called to get the value returned by a given process
@@ -84,15 +251,32 @@ public :
     //
     // In this particular implementation, we have two faulty processes - the source
     // process, which returns a sort-of random value, and process ID 2, which returns
-    // a ONE always, in contradiction of the General's desired value of 0.
+    // a ONE always, in contradiction of the General's desired value of 0. Process 2
+    // can be given a different strategy for each round, see mStrategies.
     //
-    char GetValue( char value, int source, int destination, const Path &path )
+    Value GetValue( Value value, int source, int destination, const Path &path )
+    {
+        return GetValue( value, source, destination, (int) path.size() - 1 );
+    }
+    //
+    // The same, for callers that don't have paths, only the round
+    //
+    Value GetValue( Value value, int source, int destination, int round )
     {
         if ( source == mSource )
-            return (destination & 1) ? ZERO : ONE;
-        else if ( source == 2 )
-            return ONE;
-        else
+            return (destination & 1) ? mZero : mOne;
+        else if ( source == 2 ) {
+            switch ( mStrategies[ round ] ) {
+            case ECHO :
+                return value;
+            case INVERT :
+                return value == mOne ? mZero : mOne;
+            case SPLIT :
+                return (destination & 1) ? mZero : mOne;
+            default :
+                return mOne;
+            }
+        } else
             return value;
     }
     //
@@ -103,9 +287,9 @@ public :
     // of whether the default value is always 0 or always 1. In this case we've set it to 
     // a value of 1.
     //
-    char GetDefault()
+    Value GetDefault()
     {
-        return ONE;
+        return mOne;
     }
     //
     // This method is used to identify fault processes by ID
@@ -137,29 +321,642 @@ public :
     // some addition trace output
     //
     const bool mDebug;
+    //
+    // The number of flags agreed on at once in vector consensus, or zero when each
+    // value is a single item.
+    //
+    const size_t mBits;
+    //
+    // The two values this scenario uses - ZERO and ONE for binary agreement, two
+    // interned batch IDs for multi-valued agreement, or two flag vectors.
+    //
+    const Value mZero;
+    const Value mOne;
+    //
+    // The strategy process 2 follows in each round
+    //
+    std::vector<Strategy> mStrategies;
+private :
+    //
+    // The flag vector used for vector consensus: every third flag set, or the
+    // opposite if inverted.
+    //
+    static Value Flags( size_t bits, bool invert )
+    {
+        std::vector<uint64_t> words( ( bits + 63 ) / 64, 0 );
+        for ( size_t i = 0 ; i < bits ; i++ )
+            if ( ( i % 3 == 0 ) != invert )
+                words[ i / 64 ] |= (uint64_t) 1 << ( i % 64 );
+        return ValueTable::InternBits( words, bits );
+    }
+};
+
+//
+// A Transport carries a message from one process to another. Process::SendMessages()
+// hands every message it generates to a Transport, which is responsible for getting
+// it to the destination's ReceiveMessage() sooner or later. The simplest one just
+// calls ReceiveMessage() directly, but putting this in between the sender and
+// receiver lets us simulate a network, or use a real one.
+//
+// Early stopping adds a second kind of message, a claim by the source process that
+// a node is settled on a value, which goes to the destination's ReceiveClaim().
+// Only the transports of the main run ever carry one; the rest always run every
+// round, so nobody claims anything there.
+//
+class Transport {
+public :
+    virtual ~Transport() {}
+    virtual void Send( int source, int destination, const Path &path, const Node &node ) = 0;
+    virtual void Claim( int, int, const Path &, Value ) {}
+};
+
+//
+// The PathIndex numbers the nodes of the tree densely, in lexicographic order of
+// their paths, which is the order a depth-first walk visits them in. Since every
+// node at a given rank has the same number of children, the index can be worked
+// out directly as a mixed-radix number: each step down from rank r skips over the
+// subtrees of the earlier siblings, all of them Size( r + 1 ) nodes. A subtree is
+// then one contiguous run of indexes, starting with its root.
+//
+// Which sibling a step picks is the number of processes below the one it adds
+// that aren't on the path yet. The processes on the path so far are kept in a bit
+// mask, so that's a count of bits rather than a search of the path. The indexes
+// of the path's ancestors come up along the way, and can be kept as well.
+//
+class PathIndex {
+public :
+    PathIndex( int n, int m )
+        : mSizes( m + 2, 0 )
+    {
+        for ( int rank = m ; rank >= 0 ; rank-- )
+            mSizes[ rank ] = 1 + ( n - rank - 1 ) * mSizes[ rank + 1 ];
+    }
+    size_t operator()( const Path &path, size_t *ancestors = 0 ) const
+    {
+        size_t index = 0;
+        uint64_t used = (uint64_t) 1 << ( path[ 0 ] - '0' );
+        for ( size_t k = 1 ; k < path.size() ; k++ ) {
+            if ( ancestors )
+                ancestors[ k - 1 ] = index;
+            int id = path[ k ] - '0';
+            uint64_t below = used & ( ( (uint64_t) 1 << id ) - 1 );
+            size_t rank = id;
+            for ( ; below ; below &= below - 1 )
+                rank--;
+            index += 1 + rank * mSizes[ k ];
+            used |= (uint64_t) 1 << id;
+        }
+        return index;
+    }
+    //
+    // The number of nodes in a subtree whose root has the given rank. Size( 0 ) is
+    // the whole tree.
+    //
+    size_t Size( int rank ) const
+    {
+        return mSizes[ rank ];
+    }
+private :
+    std::vector<size_t> mSizes;     //Subtree sizes by rank
+};
+
+#if __cplusplus >= 201103L
+//
+// For a fixed shape the topology never changes, so it can be worked out by the
+// compiler instead. StaticTopology<N, M, SOURCE> holds the rank, parent and sender
+// of every node as constexpr tables, numbered the same way as the PathIndex, and
+// they end up as plain data in the binary: using them takes no topology work and
+// no allocation at startup. The children of a node are at fixed strides after it,
+// so they don't need a table of their own, see Child().
+//
+// The tables are filled in by expanding a list of the node numbers. The list is
+// built by doubling, so the compiler only nests templates as deep as the log of
+// its length, but every entry is still worked out at compile time, so this is
+// meant for the small shapes we run in practice: StaticShape refuses anything
+// over STATIC_TOPOLOGY_LIMIT nodes. It needs C++11; older compilers just don't
+// see it.
+//
+// TopologyRules has the recursions that work out each entry. A node is found by
+// walking down from the root, each step picking the child whose subtree holds it.
+// Since C++11 constexpr functions are a single expression, everything is a
+// conditional and the walk is a recursion.
+//
+template <int n, int m, int source>
+struct TopologyRules {
+    static constexpr size_t Size( int rank )
+    {
+        return rank > m ? 0 : 1 + ( n - rank - 1 ) * Size( rank + 1 );
+    }
+    static constexpr size_t Branch( size_t k, size_t root, int rank )
+    {
+        return ( k - root - 1 ) / Size( rank + 1 );
+    }
+    static constexpr size_t Next( size_t k, size_t root, int rank )
+    {
+        return root + 1 + Branch( k, root, rank ) * Size( rank + 1 );
+    }
+    static constexpr int Rank( size_t k, size_t root = 0, int rank = 0 )
+    {
+        return k == root ? rank : Rank( k, Next( k, root, rank ), rank + 1 );
+    }
+    static constexpr int Parent( size_t k, size_t root = 0, int rank = 0 )
+    {
+        return k == 0 ? -1
+             : Next( k, root, rank ) == k ? (int) root
+             : Parent( k, Next( k, root, rank ), rank + 1 );
+    }
+    //
+    // The i'th process not in the used mask, which is the process that the i'th
+    // child of a node with those processes on its path adds.
+    //
+    static constexpr int Free( uint32_t used, size_t i, int id = 0 )
+    {
+        return ( used >> id ) & 1 ? Free( used, i, id + 1 )
+             : i == 0 ? id
+             : Free( used, i - 1, id + 1 );
+    }
+    static constexpr int Sender( size_t k, size_t root = 0, int rank = 0,
+                                 uint32_t used = 1u << source, int last = source )
+    {
+        return k == root ? last
+             : Sender( k, Next( k, root, rank ), rank + 1,
+                       used | 1u << Free( used, Branch( k, root, rank ) ),
+                       Free( used, Branch( k, root, rank ) ) );
+    }
+};
+
+const size_t STATIC_TOPOLOGY_LIMIT = 4096;
+
+template <int n, int m, int source>
+struct StaticShape {
+    static_assert( n <= 32, "StaticTopology keeps the processes on a path in a 32-bit mask" );
+    static_assert( TopologyRules<n, m, source>::Size( 0 ) <= STATIC_TOPOLOGY_LIMIT,
+                   "This shape has too many nodes for compile-time topology tables, "
+                   "leave STATIC_TOPOLOGY off or raise STATIC_TOPOLOGY_LIMIT" );
+    static constexpr size_t NODES = TopologyRules<n, m, source>::Size( 0 ) <= STATIC_TOPOLOGY_LIMIT
+                                  ? TopologyRules<n, m, source>::Size( 0 ) : 0;
+};
+
+template <size_t... K>
+struct NodeList {};
+template <class First, class Second>
+struct JoinNodeLists;
+template <size_t... A, size_t... B>
+struct JoinNodeLists<NodeList<A...>, NodeList<B...> > {
+    typedef NodeList<A..., sizeof...( A ) + B...> Type;
+};
+template <size_t count>
+struct MakeNodeList {
+    typedef typename JoinNodeLists<typename MakeNodeList<count / 2>::Type,
+                                   typename MakeNodeList<count - count / 2>::Type>::Type Type;
+};
+template <>
+struct MakeNodeList<0> {
+    typedef NodeList<> Type;
+};
+template <>
+struct MakeNodeList<1> {
+    typedef NodeList<0> Type;
+};
+
+template <int n, int m, int source,
+          class Nodes = typename MakeNodeList<StaticShape<n, m, source>::NODES>::Type>
+class StaticTopology;
+
+template <int n, int m, int source, size_t... K>
+class StaticTopology<n, m, source, NodeList<K...> > {
+public :
+    static constexpr size_t NODES = sizeof...( K );
+    static constexpr int mRank[ NODES ] = { TopologyRules<n, m, source>::Rank( K )... };
+    static constexpr int mParent[ NODES ] = { TopologyRules<n, m, source>::Parent( K )... };
+    static constexpr int mSender[ NODES ] = { TopologyRules<n, m, source>::Sender( K )... };
+    //
+    // The number of nodes in a subtree whose root has the given rank, as in PathIndex
+    //
+    static constexpr size_t Size( int rank )
+    {
+        return TopologyRules<n, m, source>::Size( rank );
+    }
+    static constexpr size_t Child( size_t k, size_t i )
+    {
+        return k + 1 + i * Size( mRank[ k ] + 1 );
+    }
+};
+
+template <int n, int m, int source, size_t... K>
+constexpr int StaticTopology<n, m, source, NodeList<K...> >::mRank[];
+template <int n, int m, int source, size_t... K>
+constexpr int StaticTopology<n, m, source, NodeList<K...> >::mParent[];
+template <int n, int m, int source, size_t... K>
+constexpr int StaticTopology<n, m, source, NodeList<K...> >::mSender[];
+#endif
+
+//
+// A NodeStore holds the trees of all the processes, by process and PathIndex, for
+// the engines that don't keep them in the processes themselves.
+//
+// A store may hold back what is written until Flush() is called, so Get() is only
+// sure to see nodes written before the last Flush(). The engines flush after each
+// round, since a round only reads what earlier ones wrote, and once they're done
+// deciding.
+//
+// A store that shares nodes between processes can share decisions too. Once a
+// process has decided a subtree, the given number of nodes from the given index, it
+// calls Decided(). IsDecided() then tells any process that has the very same subtree,
+// outputs included, so that it can take the output of the subtree's root and skip
+// the rest.
+//
+class NodeStore {
+public :
+    virtual ~NodeStore() {}
+    virtual Node Get( int process, size_t index ) = 0;
+    virtual void SetInput( int process, size_t index, Value value ) = 0;
+    virtual void SetOutput( int process, size_t index, Value value ) = 0;
+    virtual void Flush() {}
+    virtual void Decided( int, size_t, size_t ) {}
+    virtual bool IsDecided( int, size_t, size_t )
+    {
+        return false;
+    }
+};
+
+//
+// The SharedNodeStore keeps one canonical tree that all the processes share, and
+// lets a process copy a chunk of it only when its own values differ. That's most
+// of the time not the case: a loyal relay sends the same value to everybody, so
+// the processes' trees only differ at nodes relayed by a faulty process.
+//
+// Every process has a table of pointers to chunks of Chunk::SIZE nodes, which all
+// start out pointing at the canonical chunks. The first value written to a node
+// of the canonical tree becomes its canonical value. A process writing a value
+// that is already there does nothing, and one writing a different value gets a
+// private copy of the chunk first, unless it already has one. Chunks are
+// reference counted, the canonical tree holding one reference to each of its own.
+//
+// Since the whole tree is visible to every process that shares it, a process that
+// reads a node it never wrote sees the canonical value, not FAULTY. In the plain
+// protocol everybody but the source receives every node, so that doesn't matter.
+// With early stopping the nodes nobody sends are below settled ones, which are
+// never read, but with fault detection a process would read the canonical value
+// where it ignored a message, so the two don't go together.
+//
+// The chunks double as fingerprints of the subtrees in them. A process that sees
+// the canonical chunk has the canonical nodes, so if all the chunks a subtree covers
+// are canonical, that's the canonical subtree, found with a pointer compare per chunk
+// instead of a look at every node. When such a process decides it, every output it
+// writes lands in the canonical tree, or is there already, and if the chunks are
+// still canonical afterwards, the canonical subtree is decided for good: nobody can
+// change a canonical value once it's written. Decided() remembers that, and any
+// other process that has the canonical subtree gets it from IsDecided() for free.
+// With a loyal source, that's every subtree no traitor relayed.
+//
+class SharedNodeStore : public NodeStore {
+public :
+    SharedNodeStore( int n, size_t nodes )
+        : mChunks( ( nodes + Chunk::SIZE - 1 ) / Chunk::SIZE )
+        , mTables( n )
+        , mDecided( nodes, false )
+        , mHits( 0 )
+        , mMisses( 0 )
+    {
+        for ( size_t i = 0 ; i < mChunks.size() ; i++ ) {
+            mChunks[ i ] = new Chunk;
+            mChunks[ i ]->refs = 1 + n;
+        }
+        for ( int p = 0 ; p < n ; p++ )
+            mTables[ p ] = mChunks;
+    }
+    ~SharedNodeStore()
+    {
+        for ( size_t p = 0 ; p < mTables.size() ; p++ )
+            for ( size_t i = 0 ; i < mTables[ p ].size() ; i++ )
+                Release( mTables[ p ][ i ] );
+        for ( size_t i = 0 ; i < mChunks.size() ; i++ )
+            Release( mChunks[ i ] );
+    }
+    Node Get( int process, size_t index )
+    {
+        return mTables[ process ][ index / Chunk::SIZE ]->nodes[ index % Chunk::SIZE ];
+    }
+    void SetInput( int process, size_t index, Value value )
+    {
+        Node *node = Writable( process, index, &Node::input_value, value );
+        if ( node )
+            node->input_value = value;
+    }
+    void SetOutput( int process, size_t index, Value value )
+    {
+        Node *node = Writable( process, index, &Node::output_value, value );
+        if ( node )
+            node->output_value = value;
+    }
+    void Decided( int process, size_t index, size_t count )
+    {
+        if ( IsCanonical( process, index, count ) )
+            mDecided[ index ] = true;
+    }
+    bool IsDecided( int process, size_t index, size_t count )
+    {
+        if ( mDecided[ index ] && IsCanonical( process, index, count ) ) {
+            mHits++;
+            return true;
+        }
+        mMisses++;
+        return false;
+    }
+    //
+    // How many subtrees were found decided already, and how many had to be worked out
+    //
+    size_t Hits()
+    {
+        return mHits;
+    }
+    size_t Misses()
+    {
+        return mMisses;
+    }
+    //
+    // The number of chunks in use, canonical and private, and how many a private
+    // tree per process would have needed
+    //
+    size_t Chunks()
+    {
+        size_t count = mChunks.size();
+        for ( size_t p = 0 ; p < mTables.size() ; p++ )
+            for ( size_t i = 0 ; i < mTables[ p ].size() ; i++ )
+                if ( mTables[ p ][ i ] != mChunks[ i ] )
+                    count++;
+        return count;
+    }
+    size_t Unshared()
+    {
+        return mTables.size() * mChunks.size();
+    }
+private :
+    struct Chunk {
+        enum { SIZE = 64 };
+        size_t refs;
+        Node nodes[ SIZE ];
+    };
+    //
+    // Finds the node to write the given field of, copying its chunk if need be.
+    // Returns null if the value is already there.
+    //
+    Node *Writable( int process, size_t index, Value Node::*field, Value value )
+    {
+        Chunk *&chunk = mTables[ process ][ index / Chunk::SIZE ];
+        Node *node = &chunk->nodes[ index % Chunk::SIZE ];
+        if ( node->*field == value )
+            return 0;
+        if ( chunk == mChunks[ index / Chunk::SIZE ] && node->*field == FAULTY )
+            return node;
+        if ( chunk->refs > 1 ) {
+            Chunk *copy = new Chunk( *chunk );
+            copy->refs = 1;
+            chunk->refs--;
+            chunk = copy;
+        }
+        return &chunk->nodes[ index % Chunk::SIZE ];
+    }
+    void Release( Chunk *chunk )
+    {
+        if ( --chunk->refs == 0 )
+            delete chunk;
+    }
+    //
+    // Whether the process sees the canonical chunks for all the given nodes
+    //
+    bool IsCanonical( int process, size_t index, size_t count )
+    {
+        for ( size_t i = index / Chunk::SIZE ; i <= ( index + count - 1 ) / Chunk::SIZE ; i++ )
+            if ( mTables[ process ][ i ] != mChunks[ i ] )
+                return false;
+        return true;
+    }
+    std::vector<Chunk *> mChunks;                   //The canonical tree
+    std::vector<std::vector<Chunk *> > mTables;     //The chunks each process sees
+    std::vector<bool> mDecided;                     //Canonical subtrees decided, by root
+    size_t mHits;
+    size_t mMisses;
 };
 
+//
+// The DeltaNodeStore doesn't store trees at all, just the ways each process's tree
+// differs from the one a fully honest run would have produced. In an honest run
+// every node, input and output, holds the value the source proposed, so that's the
+// baseline. Each process has a vector of the nodes that differ, sorted by index,
+// and a lookup is a binary search that falls back on the baseline.
+//
+// New nodes aren't inserted into the sorted vector, which would move half of it
+// every time. They're appended to a pending vector, and Flush() sorts that once and
+// merges it in. A node that is already there is updated in place, and one that goes
+// back to the baseline stays until the next Flush() drops it.
+//
+// A node nobody wrote reads as the baseline rather than FAULTY, so as with the
+// SharedNodeStore, a process backed by this has to receive every node it reads.
+//
+// With a loyal source and a traitor or two, only the nodes those traitors relayed,
+// and whatever their lies tip over, end up in there. A faulty source is another
+// matter: it sets half of the first round apart, and everything relayed from there.
+// That's the worst case, and then most nodes differ - at N = 13 and M = 5, about two
+// in three of them. An entry is an index as well as a node, half as big again as a
+// node in a dense tree, so then this takes more memory than dense storage would.
+//
+class DeltaNodeStore : public NodeStore {
+public :
+    DeltaNodeStore( int n, Value baseline )
+        : mDeltas( n )
+        , mPending( n )
+        , mChanged( n, false )
+        , mBaseline( baseline )
+    {}
+    Node Get( int process, size_t index )
+    {
+        std::vector<Entry> &deltas = mDeltas[ process ];
+        std::vector<Entry>::iterator ii = Find( deltas, index );
+        if ( ii == deltas.end() || ii->first != index )
+            return Node( mBaseline, mBaseline );
+        return ii->second;
+    }
+    void SetInput( int process, size_t index, Value value )
+    {
+        Set( process, index, &Node::input_value, value );
+    }
+    void SetOutput( int process, size_t index, Value value )
+    {
+        Set( process, index, &Node::output_value, value );
+    }
+    //
+    // Merges the pending nodes of each process into its sorted ones, dropping any
+    // that are back to the baseline. A node that was added twice since the last
+    // Flush() keeps what was written last, so the sort has to be stable. Processes
+    // nobody wrote to since are skipped.
+    //
+    void Flush()
+    {
+        for ( size_t p = 0 ; p < mDeltas.size() ; p++ ) {
+            if ( !mChanged[ p ] )
+                continue;
+            mChanged[ p ] = false;
+            std::vector<Entry> &deltas = mDeltas[ p ];
+            std::vector<Entry> &pending = mPending[ p ];
+            if ( !pending.empty() ) {
+                std::stable_sort( pending.begin(), pending.end(), Less );
+                size_t kept = 0;
+                for ( size_t i = 0 ; i < pending.size() ; i++ ) {
+                    if ( kept && pending[ kept - 1 ].first == pending[ i ].first )
+                        kept--;
+                    pending[ kept++ ] = pending[ i ];
+                }
+                size_t sorted = deltas.size();
+                deltas.insert( deltas.end(), pending.begin(), pending.begin() + kept );
+                std::inplace_merge( deltas.begin(), deltas.begin() + sorted, deltas.end(), Less );
+                std::vector<Entry>().swap( pending );
+            }
+            deltas.erase( std::remove_if( deltas.begin(), deltas.end(), IsBaseline( mBaseline ) ), deltas.end() );
+        }
+    }
+    //
+    // The number of nodes stored for all the processes together
+    //
+    size_t Entries()
+    {
+        Flush();
+        size_t count = 0;
+        for ( size_t p = 0 ; p < mDeltas.size() ; p++ )
+            count += mDeltas[ p ].size();
+        return count;
+    }
+private :
+    typedef std::pair<uint32_t, Node> Entry;
+    static bool Before( const Entry &entry, size_t index )
+    {
+        return entry.first < index;
+    }
+    static bool Less( const Entry &a, const Entry &b )
+    {
+        return a.first < b.first;
+    }
+    struct IsBaseline {
+        IsBaseline( Value baseline )
+            : baseline( baseline )
+        {}
+        bool operator()( const Entry &entry ) const
+        {
+            return entry.second.input_value == baseline && entry.second.output_value == baseline;
+        }
+        Value baseline;
+    };
+    static std::vector<Entry>::iterator Find( std::vector<Entry> &deltas, size_t index )
+    {
+        return std::lower_bound( deltas.begin(), deltas.end(), index, Before );
+    }
+    //
+    // Updates a node that is already there, or adds one that differs from the
+    // baseline. The engines write the two halves of a node one right after the
+    // other if at all, so a pending node is only looked for at the end.
+    //
+    void Set( int process, size_t index, Value Node::*field, Value value )
+    {
+        std::vector<Entry> &deltas = mDeltas[ process ];
+        std::vector<Entry> &pending = mPending[ process ];
+        std::vector<Entry>::iterator ii = Find( deltas, index );
+        mChanged[ process ] = true;
+        if ( ii != deltas.end() && ii->first == index )
+            ii->second.*field = value;
+        else if ( !pending.empty() && pending.back().first == index )
+            pending.back().second.*field = value;
+        else if ( value != mBaseline ) {
+            pending.push_back( Entry( (uint32_t) index, Node( mBaseline, mBaseline ) ) );
+            pending.back().second.*field = value;
+        }
+    }
+    std::vector<std::vector<Entry> > mDeltas;   //The nodes that differ, by process
+    std::vector<std::vector<Entry> > mPending;  //Nodes added since the last Flush()
+    std::vector<bool> mChanged;                 //Processes written to since then
+    Value mBaseline;
+};
     
 class Process {
 public :
     //
-    // The Process constructor only has a couple of interesting thigns to do.
-    // First, if it finds that the static mChildren map is empty, it calls
-    // GenerateChildren(), a static method which generats the map used throughout
-    // the program to diagram the tree which holds the topology of the message
-    // tree. See GenerateChildren() below for details.
+    // A list of paths from one level of the topology, see Level(). Either it is a
+    // run of consecutive positions in the level, or it has a list of them. The paths
+    // themselves are made up from the level's buffer when they're asked for, so they
+    // come back by value.
+    //
+    class PathList {
+    public :
+        PathList()
+            : mPaths( 0 )
+            , mLength( 0 )
+            , mPositions( 0 )
+            , mFirst( 0 )
+            , mCount( 0 )
+        {}
+        PathList( const char *paths, size_t length, const uint32_t *positions, size_t first, size_t count )
+            : mPaths( paths )
+            , mLength( length )
+            , mPositions( positions )
+            , mFirst( first )
+            , mCount( count )
+        {}
+        size_t size() const
+        {
+            return mCount;
+        }
+        bool empty() const
+        {
+            return mCount == 0;
+        }
+        Path operator[]( size_t i ) const
+        {
+            return Path( mPaths + Position( i ) * mLength, mLength );
+        }
+        //
+        // The position in the level of the i'th path, and the other way around
+        //
+        size_t Position( size_t i ) const
+        {
+            return mPositions ? mPositions[ i ] : mFirst + i;
+        }
+        size_t Find( size_t position ) const
+        {
+            if ( !mPositions )
+                return position - mFirst;
+            return std::lower_bound( mPositions, mPositions + mCount, (uint32_t) position ) - mPositions;
+        }
+    private :
+        const char *mPaths;         //The level's buffer
+        size_t mLength;             //The length of its paths
+        const uint32_t *mPositions; //The positions in the list, or null for a run
+        size_t mFirst;              //The first position of a run
+        size_t mCount;
+    };
+    //
+    // The Process constructor only has one interesting thing to do. If this is the
+    // source process (the General) we initialize the default path with the General's
+    // source value - a node that will contain the General's proposed value and
+    // nothing else. It is kept apart from the tree, see mGeneral.
     //
-    // The second thing of note is that if this is the source process (the General)
-    // we initialize the default path with the General's source value - a node
-    // that will contain the General's proposed value and nothing else.
+    // The topology of the message tree is shared by all processes, and generated
+    // a level at a time as it is needed. See Level() below for details.
     //
     Process( int id ) 
         : mId( id )
+        , mStore( 0 )
+        , mEarlyRound( -1 )
+        , mFaulty( mTraits.mN, false )
+        , mFaultyCount( 0 )
+        , mIgnored( 0 )
+        , mIncremental( false )
+        , mReceived( 0 )
+        , mFixedAfter( 0 )
+        , mDiscarded( 0 )
+        , mVisited( 0 )
     {
-        if ( mChildren.size() == 0 )
-            GenerateChildren( mTraits.mM, mTraits.mN, std::vector<bool>( mTraits.mN, true ) );
         if ( mId == mTraits.mSource )
-            mNodes[ "" ] = mTraits.GetSourceValue();
+            mGeneral = mTraits.GetSourceValue();
     }
     //
     // After constructing all messages, you need to call SendMessages on each process,
@@ -167,7 +964,7 @@ public :
     // to all th eother processes listed in the vector passed in as an argument.
     //
     // Deciding on what messages to send is pretty simple. If we look at the static
-    // map mPathsByRank, indexed by round and the processId of this process, it gives 
+    // map returned by Level(), indexed by round and the processId of this process, it gives 
     // the entire set of taraget paths that this process needs to send messages to.
     // So there is an iteration loop through that map, and this process sends a message
     // to the correct target process for each path in the map.
@@ -179,234 +976,3603 @@ public :
     // Also, if the debug flag is turned on, information about the message is printed to the
     // console.
     //
-    void SendMessages( int round, std::vector<Process> &processes )
+    // Paths that lie below a node that every loyal process has settled (see
+    // FindSettled() below) are skipped, since nobody needs them any more. So is
+    // anything we hold no value for, which happens once we ignore a process that has
+    // been caught lying (see FindFaulty()): a message that never arrives reads as
+    // FAULTY, which is what we'd be relaying. The return value is the number of
+    // messages actually sent, which lets the caller report the savings.
+    //
+    size_t SendMessages( int round, std::vector<Process> &processes )
     {
-        for ( size_t i = 0 ; i < mPathsByRank[ round ][ mId ].size() ; i++ )
+        DirectTransport transport( processes );
+        return SendMessages( round, transport );
+    }
+    //
+    // The same thing, but the messages go out through the given Transport instead of
+    // straight into the destination process.
+    //
+    size_t SendMessages( int round, Transport &transport )
+    {
+        size_t sent = 0;
+        PathList paths = Level( round, mId );
+        for ( size_t i = 0 ; i < paths.size() ; i++ )
         {
-            Path source_node_path = mPathsByRank[ round ][ mId ][ i ];
-            source_node_path = source_node_path.substr( 0, source_node_path.size() - 1 );
-            Node source_node = mNodes[ source_node_path ];
+            Path path = paths[ i ];
+            if ( IsPruned( path ) )
+                continue;
+            Path source_node_path = path.substr( 0, path.size() - 1 );
+            Node source_node;
+            if ( !FindNode( source_node_path, source_node ) )
+                continue;
             for ( size_t j = 0 ; j < mTraits.mN ; j++ )
                 if ( j != mTraits.mSource ) {
-                    char value = mTraits.GetValue( source_node.input_value,
+                    Value value = mTraits.GetValue( source_node.input_value,
                                                    mId,
                                                    (int) j,
-                                                   mPathsByRank[ round ][ mId ][ i ] );
+                                                   path );
                     if ( mTraits.mDebug )
                         std::cout << "Sending from process " << mId 
                                   << " to " << static_cast<unsigned int>( j )
-                                  << ": {" << value << ", " 
-                                  << mPathsByRank[ round ][ mId ][ i ]
-                                  << ", " << UNKNOWN << "}"
+                                  << ": {" << ValueTable::Format( value ) << ", " 
+                                  << path
+                                  << ", " << ValueTable::Format( UNKNOWN ) << "}"
                                   << ", getting value from source_node " << source_node_path
                                   << "\n";
-                    processes[ j ].ReceiveMessage( mPathsByRank[ round ][ mId ][ i ], 
-                                                   Node( value, UNKNOWN ) );
+                    transport.Send( mId,
+                                    (int) j,
+                                    path,
+                                    Node( value, UNKNOWN ) );
+                    sent++;
                 }
         }
+        return sent;
     }
     //
     // After all messages have been sent, it's time to Decide.
     // 
     // This part of the algorithm follows the description in the article closely.
     // It has to work its way from the leaf values up to the root of the tree.
-    // The first round consists of going to the leaf nodes, and copying the input
-    // value to the output value.
-    //
-    // All subsequent rounds consist of getting the majority of the output values from
-    // each nodes children, and copying that to the nodes output value.
+    // The leaf nodes just copy their input value to their output value. Every other
+    // node gets the majority of the output values of its children, and copies that
+    // to its output value.
     //
     // When we finally reach the root node, there is only one node with an output value,
     // and that represents this processes decision.
     //
-    char Decide()
+    // Rather than going up the tree a level at a time, the nodes are visited depth
+    // first, which works out each node as soon as its children are done. That walk
+    // goes by PathIndex number, where the children of a node follow it at fixed
+    // strides, so it doesn't need the topology at all. The path is built up as it
+    // goes, for the lookups that need one.
+    //
+    // Settled nodes take a substitute value instead of a majority, and anything below
+    // them is ignored - those messages may never have been sent.
+    //
+    // With a store that shares decisions (see NodeStore), subtrees that some other
+    // process has decided already are taken from there. That's only done when this
+    // process has nothing settled, since the store knows nothing about substitutes.
+    // The same goes for the subtree memo, see GetMajority().
+    //
+    Value Decide()
     {
         //
         // The source process doesn't have to do all the work - since it's the decider,
         // it simply looks at its input value to pick the appropriate decision value.
         //
         if ( mId == mTraits.mSource )
-            return mNodes[ "" ].input_value;
-        //
-        // Step 1 - set the leaf values
-        //
-        for ( size_t i = 0 ; i < mTraits.mN ; i++ )
-            for ( size_t j = 0 ; j < mPathsByRank[ mTraits.mM ][ i ].size() ; j++ )
-            {
-                const Path &path = mPathsByRank[ mTraits.mM ][ i ][ j ];
-                Node &node = mNodes[ path ];
-                node.output_value = node.input_value;
-            }
-        //
-        // Step 2 - work up the tree
-        //
-        for ( int round = (int) mTraits.mM - 1 ; round >= 0 ; round-- )
-        {
+            return mGeneral.input_value;
+        mCounts.clear();
+        Path path = RootPath();
+        Value value = Decide( path, 0 );
+        if ( mStore )
+            mStore->Flush();
+        return value;
+    }
+    //
+    // Early stopping support. After a round of messaging, FindSettled() looks at every
+    // node whose children have all arrived and asks whether its outcome is already fixed
+    // at *every* loyal process, not just this one. Two rules establish that, both relying
+    // on the usual assumption that there are at most M faulty processes:
+    //
+    // 1. Say a node has n children, and more than n/2 + M - 1 of them hold the same
+    //    value. If the node's sender was loyal, more than M loyal relays are reporting
+    //    that value, so it is what the sender sent. If the sender was faulty, at most
+    //    M - 1 of the relays can be faulty too, so more than n/2 loyal relays received
+    //    that value. Either way, since a loyal relay's subtree always resolves to what
+    //    it relayed, the node resolves to that value everywhere.
+    //
+    // 2. If more than half of a node's children are settled on the same value, the node
+    //    is settled on it too.
+    //
+    // This process can take what it finds as settled right away, and Decide() uses the
+    // settled value instead of a majority. Nobody else can, since they only have our
+    // word for it, so each new finding goes out to every other process as a claim,
+    // through the transport like any other message. Returns the number of claims sent.
+    //
+    size_t FindSettled( int round, Transport &transport )
+    {
+        size_t sent = 0;
+        if ( mId == mTraits.mSource || round < 1 )
+            return sent;
+        for ( int rank = round - 1 ; rank >= 0 ; rank-- )
             for ( size_t i = 0 ; i < mTraits.mN ; i++ )
-                for ( size_t j = 0 ; j < mPathsByRank[ round ][ i ].size() ; j++ )
+                for ( size_t j = 0 ; j < Level( rank, i ).size() ; j++ )
                 {
-                    const Path &path = mPathsByRank[ round ][ i ][ j ];
-                    Node &node = mNodes[ path ];
-                    node.output_value = GetMajority( path );
+                    const Path &path = Level( rank, i )[ j ];
+                    Value value;
+                    if ( IsPruned( path ) || mSettled.count( path ) || !IsSettled( path, value ) )
+                        continue;
+                    mSettled[ path ] = value;
+                    mClaims[ std::make_pair( path, value ) ].push_back( mId );
+                    for ( size_t k = 0 ; k < mTraits.mN ; k++ )
+                        if ( k != (size_t) mId ) {
+                            transport.Claim( mId, (int) k, path, value );
+                            sent++;
+                        }
+                }
+        NoteEarlyRound( round );
+        return sent;
+    }
+    void ReceiveClaim( int sender, const Path &path, Value value )
+    {
+        std::vector<int> &claimants = mClaims[ std::make_pair( path, value ) ];
+        if ( std::find( claimants.begin(), claimants.end(), sender ) == claimants.end() )
+            claimants.push_back( sender );
+    }
+    //
+    // Once all the claims of a round have been delivered, each process weighs the ones
+    // it has. More than M processes claiming the same thing means at least one loyal
+    // process found it, so it's true, and we settle the node too.
+    //
+    // That isn't enough to stop sending the subtree below it, since some loyal process
+    // might not have heard enough claims yet and still need those messages. But with
+    // more than 2M claimants, more than M of them are loyal and sent their claim to
+    // everybody, so every loyal process settles the node in this same step. From then
+    // on nobody needs the subtree, and it is neither sent nor kept (see IsPruned()).
+    //
+    void AdoptSettled( int round )
+    {
+        std::map<std::pair<Path,Value>, std::vector<int> >::const_iterator ii;
+        for ( ii = mClaims.begin() ; ii != mClaims.end() ; ii++ ) {
+            const Path &path = ii->first.first;
+            if ( ii->second.size() > (size_t) mTraits.mM && !mSettled.count( path ) )
+                mSettled[ path ] = ii->first.second;
+            if ( ii->second.size() > 2 * (size_t) mTraits.mM )
+                mShared[ path ] = ii->first.second;
+        }
+        NoteEarlyRound( round );
+    }
+    //
+    // The round after which this process could have decided, or -1 if it had to wait
+    // for all the messages.
+    //
+    int EarlyRound()
+    {
+        return mEarlyRound;
+    }
+    //
+    // Fault detection. After round r, each of our nodes of rank r-1 has a full set of
+    // children, where child k holds what process k says the node's sender told it.
+    // If more than M of those relays agree on a value other than the one the sender
+    // told us directly, at least one of them is loyal, so the sender told different
+    // processes different things. A loyal process never does that, so the sender is
+    // faulty. A missing value proves nothing, since a loyal process has nothing to
+    // relay for a node it never got (see SendMessages()).
+    //
+    // What a process finds is its own business. It can't show anyone else the proof,
+    // since with oral messages the others only have our word for what we were told,
+    // and loyal processes that substituted values for different processes could end
+    // up deciding differently. So all we do is ignore whatever a detected process
+    // sends from now on, which is no different from it having sent nothing at all -
+    // something it was free to do anyway, being faulty - and then the usual argument
+    // for agreement still holds. Returns the number of processes newly detected.
+    //
+    size_t FindFaulty( int round )
+    {
+        size_t found = 0;
+        if ( mId == mTraits.mSource || round < 1 )
+            return found;
+        for ( size_t i = 0 ; i < mTraits.mN ; i++ )
+            for ( size_t j = 0 ; j < Level( round - 1, i ).size() ; j++ )
+            {
+                const Path &path = Level( round - 1, i )[ j ];
+                Node node;
+                if ( i == (size_t) mId || mFaulty[ i ] || IsPruned( path ) || !FindNode( path, node ) )
+                    continue;
+                size_t conflicts = 0;
+                for ( size_t k = 0 ; k < Children( path ).size() ; k++ ) {
+                    const Path &child = Children( path )[ k ];
+                    Node relayed;
+                    if ( child[ child.size() - 1 ] - '0' != mId
+                         && FindNode( child, relayed )
+                         && relayed.input_value != node.input_value
+                         && ValueTable::IsProper( relayed.input_value ) )
+                        conflicts++;
+                }
+                if ( conflicts > (size_t) mTraits.mM ) {
+                    mFaulty[ i ] = true;
+                    mFaultyCount++;
+                    found++;
+                }
+            }
+        return found;
+    }
+    //
+    // Whether this process has caught the given one lying, and how many messages it
+    // has ignored because of it
+    //
+    bool Suspects( int process )
+    {
+        return mFaulty[ process ];
+    }
+    size_t Ignored()
+    {
+        return mIgnored;
+    }
+    //
+    // The number of messages that a full run of the given round sends, regardless
+    // of who is sending them.
+    //
+    static size_t MessageCount( int round )
+    {
+        return PathCount( round ) * ( mTraits.mN - 1 );
+    }
+    //
+    // The number of paths of a given rank. Each step down has one process fewer
+    // to choose from, so there's no need to generate them to count them.
+    //
+    static size_t PathCount( int rank )
+    {
+        size_t count = 1;
+        for ( int k = 1 ; k <= rank ; k++ )
+            count *= mTraits.mN - k;
+        return count;
+    }
+    //
+    // The value every process falls back on, see Traits::GetDefault()
+    //
+    static Value DefaultValue()
+    {
+        return mTraits.GetDefault();
+    }
+    //
+    // What a general proposes when it is a source, see Traits::GetProposal()
+    //
+    static Value Proposal( int id )
+    {
+        return mTraits.GetProposal( id );
+    }
+    //
+    // What a process sends on to a destination when it should be relaying the given
+    // value, for engines that do their own messaging
+    //
+    static Value Relay( Value value, int sender, int destination, int round )
+    {
+        return mTraits.GetValue( value, sender, destination, round );
+    }
+    //
+    // The paths a given process sends in a given round, in their canonical order.
+    // Everybody has the same static topology, so this order is something all the
+    // processes agree on without having to say so.
+    //
+    static PathList PathsFor( int round, int sender )
+    {
+        return Level( round, sender );
+    }
+    //
+    // The position of a path in PathsFor() its round and last sender. Messages go out
+    // in that order, so the path is usually the one at the cursor, where the last
+    // path was found, or the one after it. Otherwise it's a binary search, since the
+    // list is in order of position in the level.
+    //
+    static size_t PathPosition( const Path &path, size_t &cursor )
+    {
+        PathList paths = PathsFor( (int) path.size() - 1, path[ path.size() - 1 ] - '0' );
+        size_t position = Position( path );
+        size_t i = cursor;
+        if ( i < paths.size() && paths.Position( i ) != position )
+            i++;
+        if ( i >= paths.size() || paths.Position( i ) != position )
+            i = paths.Find( position );
+        cursor = i;
+        return i;
+    }
+    //
+    // The root of the tree, which holds what the source told us
+    //
+    static Path RootPath()
+    {
+        return Path( 1, static_cast<char>( mTraits.mSource + '0' ) );
+    }
+    //
+    // The children of a node in the static topology
+    //
+    static PathList ChildrenOf( const Path &path )
+    {
+        return Children( path );
+    }
+    //
+    // Looks up a node, for code that only wants to read the tree. Returns false if
+    // nothing was ever stored there.
+    //
+    // A node that was never stored reads as an empty Node, with a FAULTY input. No
+    // process ever sends FAULTY, since it isn't a proper value, so that's how we can
+    // tell. The empty path is the General's own node, which only the source has.
+    //
+    bool FindNode( const Path &path, Node &node ) const
+    {
+        if ( path.empty() )
+            node = mGeneral;
+        else if ( mId == mTraits.mSource )
+            return false;
+        else
+            node = Get( mIndex( path ) );
+        return node.input_value != FAULTY;
+    }
+    //
+    // Whether two processes stored the same nodes with the same inputs, which is
+    // what a replay has to reproduce. The outputs only come from deciding.
+    //
+    // In a store, a node this process never got reads as whatever the store has
+    // there, see SetStore(). So if either tree is in one, only the nodes this one
+    // has are compared.
+    //
+    bool SameInputs( const Process &that ) const
+    {
+        bool stored = mStore || that.mStore;
+        for ( size_t k = 0 ; k < mIndex.Size( 0 ) ; k++ ) {
+            Value value = Get( k ).input_value;
+            if ( value != that.Get( k ).input_value && !( stored && value == FAULTY ) )
+                return false;
+        }
+        return true;
+    }
+    //
+    // Keeps the tree of this process in the given store from now on, instead of in
+    // a tree of its own. That has to be done before the first message arrives, and
+    // the store has to outlive the process. The source has no tree, so it ignores
+    // this.
+    //
+    // A store can't tell a node that was never stored from one that was, so those
+    // read as whatever the store holds there instead of FAULTY. In the plain
+    // protocol every process but the source gets every node, and with early stopping
+    // the ones it doesn't get are pruned, and never looked at. Fault detection
+    // ignores messages, and a relay has to be able to tell that it has nothing to
+    // relay, so it doesn't go with a store.
+    //
+    void SetStore( NodeStore *store )
+    {
+        if ( mId != mTraits.mSource )
+            mStore = store;
+    }
+    int Id()
+    {
+        return mId;
+    }
+    //
+    // A utility routine that tells whether a given process is faulty
+    //
+    bool IsFaulty()
+    {
+        return mTraits.IsFaulty( mId );
+    }
+    //
+    // Another somewhat handy utility routine
+    //
+    bool IsSource()
+    {
+        return mTraits.mSource == mId;
+    }
+    //
+    // Throws away everything this process learned, so the same object can take part
+    // in a fresh agreement. The topology is shared and stays put.
+    //
+    void Reset()
+    {
+        std::fill( mNodes.begin(), mNodes.end(), Node() );
+        mSettled.clear();
+        mShared.clear();
+        mClaims.clear();
+        std::fill( mFaulty.begin(), mFaulty.end(), false );
+        mFaultyCount = 0;
+        mIgnored = 0;
+        mEarlyRound = -1;
+        mTallies.clear();
+        mReceived = 0;
+        mFixedAfter = 0;
+        mDiscarded = 0;
+        mCounts.clear();
+        std::fill( mSums.begin(), mSums.end(), 0 );
+        if ( mId == mTraits.mSource )
+            mGeneral = mTraits.GetSourceValue();
+    }
+    //
+    // Receiving a message is pretty simple here, it means that some other process
+    // calls this method on the current process with path and a node. All we do
+    // is store the value, we'll use it in the next round of messaging.
+    //
+    void ReceiveMessage( const Path &path, const Node &node )
+    {
+        if ( mFaultyCount && mFaulty[ path[ path.size() - 1 ] - '0' ] ) {
+            mIgnored++;
+            return;
+        }
+        if ( IsPruned( path ) )
+            return;
+        if ( !mCounts.empty() )
+            mCounts.clear();
+        size_t k = mIndex( path );
+        if ( mIncremental ) {
+            mReceived++;
+            if ( path.size() == (size_t) mTraits.mM + 1 && Get( k ).input_value == FAULTY ) {
+                if ( path.size() > 1 ) {
+                    std::map<Path,Tally>::const_iterator ii = mTallies.find( path.substr( 0, path.size() - 1 ) );
+                    if ( ii != mTallies.end() && ii->second.fixed ) {
+                        mDiscarded++;
+                        return;
+                    }
+                }
+                SetInput( k, node.input_value );
+                Rehash( path, k, node.input_value );
+                Resolve( path, node.input_value );
+                return;
+            }
+        }
+        SetInput( k, node.input_value );
+        Rehash( path, k, node.input_value );
+    }
+    //
+    // Incremental deciding. Instead of waiting for Decide() to walk the whole tree
+    // at the end, every leaf that arrives is resolved on the spot, and a tally kept
+    // for its parent. A parent resolves as soon as one value has more than half of
+    // its children, since no later child can change that, or else when the last
+    // child is in, by way of GetMajority() so that ties and flag vectors come out
+    // exactly as Decide() has them. Each resolved node counts towards its own parent
+    // in turn, so the root often resolves before the last message shows up.
+    //
+    // Once a parent is fixed, there's no point in keeping the rest of its leaves, so
+    // they are counted and dropped. A dropped leaf reads as FAULTY later on, which
+    // can't undo the strict majority that fixed the parent, so Decide() still comes
+    // out the same.
+    //
+    // This has to be turned on before the first message arrives. It covers the plain
+    // protocol; pruned subtrees from early stopping, and messages from processes
+    // caught lying by fault detection, never arrive, so with those Decide() is still
+    // the way to go. It also needs a tree of its own, since it reads back outputs as
+    // soon as they're written, and drops leaves that a store would still show.
+    //
+    void SetIncremental( bool incremental )
+    {
+        mIncremental = incremental;
+    }
+    //
+    // The incremental decision, or UNKNOWN if it isn't fixed yet
+    //
+    Value Decision()
+    {
+        if ( mId == mTraits.mSource )
+            return mGeneral.input_value;
+        if ( !mFixedAfter )
+            return UNKNOWN;
+        return Get( 0 ).output_value;
+    }
+    //
+    // The what-if engine, for trying out a different value in one node of a tree that
+    // has already been decided, and seeing what the decision becomes. Only the
+    // outputs along the path from that node to the root can change, so only those
+    // are worked out again, each from a count of its children's outputs by value.
+    // Counts are made the first time a node is touched and then kept up to date, so
+    // a level costs O(1) when one value still has a clear majority and O(N) when the
+    // full Majority() rules are needed, O(M * N) all told. Going up stops as soon as
+    // an output comes out the same as before, or at a node with a substitute.
+    //
+    // Only a leaf's input counts towards the decision; the input of an inner node
+    // is only used for relaying, so changing one just stores it. The change stays
+    // in place, so call it again with the old value to undo it. The new decision
+    // is passed back in the last argument.
+    //
+    // A node that was never stored, or is pruned by early stopping, doesn't count
+    // towards the decision at all, so there's nothing to try; the same goes for the
+    // source. Those return false and change nothing.
+    //
+    // Decide() has to have been run first, and not in incremental mode, where the
+    // leaves dropped on arrival read as FAULTY in the tree. Receiving a message or
+    // deciding again throws the counts away.
+    //
+    // A store may hold back what is written until it is flushed, see NodeStore, so
+    // the store is flushed first, and nothing written here is read back before the
+    // next call. When a majority needs the full Majority() rules, it is taken over
+    // the counts rather than the children, which comes to the same thing.
+    //
+    bool WhatIf( const Path &path, Value value, Value &decision )
+    {
+        Node node;
+        if ( mId == mTraits.mSource || !FindNode( path, node ) || IsPruned( path ) )
+            return false;
+        if ( mStore )
+            mStore->Flush();
+        size_t k = mIndex( path );
+        SetInput( k, value );
+        Rehash( path, k, value );
+        decision = Get( 0 ).output_value;
+        if ( path.size() != (size_t) mTraits.mM + 1 )
+            return true;
+        Path child = path;
+        Value old_value = node.output_value;
+        Value new_value = value;
+        while ( old_value != new_value ) {
+            if ( child.size() == 1 ) {
+                SetOutput( k, new_value );
+                decision = new_value;
+                break;
+            }
+            Path parent = child.substr( 0, child.size() - 1 );
+            Counts &counts = CountsFor( parent );
+            SetOutput( k, new_value );
+            Count( counts, old_value, -1 );
+            Count( counts, new_value, 1 );
+            Value substitute;
+            if ( GetSubstitute( parent, substitute ) )
+                break;
+            size_t n = mTraits.mN - parent.size();
+            Value majority = UNKNOWN;
+            size_t best = 0;
+            for ( size_t i = 0 ; i < counts.size() ; i++ )
+                if ( counts[ i ].second > best ) {
+                    best = counts[ i ].second;
+                    majority = counts[ i ].first;
                 }
+            if ( best > n / 2 )
+                majority = ValueTable::IsProper( majority ) ? majority : UNKNOWN;
+            else {
+                std::vector<Value> values;
+                for ( size_t i = 0 ; i < counts.size() ; i++ )
+                    values.insert( values.end(), counts[ i ].second, counts[ i ].first );
+                majority = Majority( &values[ 0 ], n );
+            }
+            k = mIndex( parent );
+            old_value = Get( k ).output_value;
+            new_value = majority;
+            child = parent;
+        }
+        return true;
+    }
+    //
+    // The number of messages this process had received when its decision was fixed,
+    // and the number received in all
+    //
+    size_t FixedAfter()
+    {
+        return mFixedAfter;
+    }
+    size_t Received()
+    {
+        return mReceived;
+    }
+    size_t Discarded()
+    {
+        return mDiscarded;
+    }
+    //
+    // Decides the same way as Decide(), but top-down, so that it can stop early. The
+    // children of a node are evaluated one at a time while keeping count of their
+    // values, and as soon as one value has more than half of them the rest can't
+    // change the outcome, so their subtrees aren't visited at all. With few faults
+    // most nodes saturate halfway through their children, and most of the tree is
+    // never looked at.
+    //
+    // Skipped nodes keep whatever output they had, so a dump after this shows
+    // stale values below the saturated nodes. The number of nodes visited is kept
+    // for reporting.
+    //
+    Value DecideBounded()
+    {
+        mVisited = 0;
+        if ( mId == mTraits.mSource )
+            return mGeneral.input_value;
+        Path path = RootPath();
+        return Evaluate( path, 0 );
+    }
+    size_t Visited()
+    {
+        return mVisited;
+    }
+    //
+    // A depth-first decision engine, which doesn't need any messages to have been
+    // sent or any of the tree to be stored. It works out what the given process
+    // would decide by following the recursive formulation of OM(m) instead: the
+    // messages for one subtree are generated, reduced to a majority, and forgotten
+    // before moving on to the next, so all that is kept is one vector of N values
+    // per level for what each process holds along the current path, and one for the
+    // children's outputs - N * M values in all, where the EIG tree holds N^M nodes.
+    //
+    // What each process holds comes straight from the Traits, the same way
+    // SendMessages() gets it, and the outputs are reduced by Majority(), so the
+    // decisions are exactly those of Decide() for the plain protocol. Early stopping
+    // and fault detection change what is sent, so they aren't covered.
+    //
+    static Value DecideDepthFirst( int id )
+    {
+        Value value = mTraits.GetSourceValue().input_value;
+        if ( id == mTraits.mSource )
+            return value;
+        Path path( 1, static_cast<char>( mTraits.mSource + '0' ) );
+        std::vector<std::vector<Value> > held( mTraits.mM + 1, std::vector<Value>( mTraits.mN ) );
+        std::vector<std::vector<Value> > outputs( mTraits.mM + 1 );
+        for ( size_t x = 0 ; x < mTraits.mN ; x++ )
+            held[ 0 ][ x ] = mTraits.GetValue( value, mTraits.mSource, (int) x, path );
+        return DepthFirst( id, path, held, outputs );
+    }
+    //
+    // Runs the plain protocol for a StaticTopology in a NodeStore, where the paths are
+    // never needed at all: the sender and parent of each node come from its tables.
+    // The messages are the same ones SendMessages() sends, and deciding is the same
+    // walk as Decide(), see DecideStored().
+    //
+    template <class Topology>
+    static void SendStatic( int round, NodeStore &store )
+    {
+        Value source_value = mTraits.GetSourceValue().input_value;
+        for ( size_t k = 0 ; k < Topology::NODES ; k++ ) {
+            if ( Topology::mRank[ k ] != round )
+                continue;
+            int sender = Topology::mSender[ k ];
+            Value value = source_value;
+            if ( round > 0 )
+                value = store.Get( sender, Topology::mParent[ k ] ).input_value;
+            for ( size_t j = 0 ; j < mTraits.mN ; j++ )
+                if ( j != (size_t) mTraits.mSource )
+                    store.SetInput( (int) j, k, mTraits.GetValue( value, sender, (int) j, round ) );
+        }
+        store.Flush();
+    }
+    template <class Topology>
+    static Value DecideStatic( int id, NodeStore &store )
+    {
+        if ( id == mTraits.mSource )
+            return mTraits.GetSourceValue().input_value;
+        Value value = DecideStored( id, store, Topology(), 0, 0 );
+        store.Flush();
+        return value;
+    }
+    //
+    // Sets the strategy of the faulty relay for a round, for every process
+    //
+    static void SetStrategy( int round, Traits::Strategy strategy )
+    {
+        mTraits.mStrategies[ round ] = strategy;
+    }
+    //
+    // The number of nodes in a full tree
+    //
+    static size_t NodeCount()
+    {
+        size_t count = 0;
+        for ( int rank = 0 ; rank <= mTraits.mM ; rank++ )
+            count += PathCount( rank );
+        return count;
+    }
+    //
+    // Turns the subtree memo on or off for all processes, see GetMajority(). The
+    // fingerprints are kept up as messages arrive, so this has to be set before the
+    // first one does. The hit and miss counts cover every majority taken since.
+    //
+    // WhatIf() reads the outputs below a node, which a hit leaves stale, so the two
+    // don't go together.
+    //
+    static void SetMemoize( bool memoize )
+    {
+        mMemoize = memoize;
+        mMemo.clear();
+        mMemoHits = 0;
+        mMemoMisses = 0;
+    }
+    static size_t MemoHits()
+    {
+        return mMemoHits;
+    }
+    static size_t MemoMisses()
+    {
+        return mMemoMisses;
+    }
+    //
+    // Frees a level of the topology. Nothing is lost: the levels don't depend on each
+    // other, so Level() and Children() just generate it again if it's asked for. Any
+    // PathList from it is gone too, so only the caller knows when that's safe.
+    //
+    // With the debug trace on, the level stays, since generating it prints it.
+    //
+    static void ReleaseLevel( int rank )
+    {
+        if ( mTraits.mDebug )
+            return;
+        std::vector<char>().swap( mLevels[ rank ].paths );
+        std::vector<uint32_t>().swap( mLevels[ rank ].senders );
+    }
+    //
+    // Builds the whole topology at once instead of a level at a time, splitting the
+    // work between the given number of threads. Every path of rank two or more is
+    // below one of the first level nodes, so each thread takes some of those and
+    // fills in their subtrees, and no two threads ever touch the same path.
+    //
+    // Nothing has to be appended or gathered afterwards. Every level is allocated at
+    // its full size first, and the subtree of each first level node is one run of
+    // positions in every level below it, see BuildSubtrees(), so the threads write
+    // their paths, and their positions in the sender blocks, straight into place.
+    //
+    // The result is the same as generating the levels one by one, which is what
+    // happens anyway with the debug trace turned on, since that prints as it goes.
+    //
+    static void BuildTopology( int threads )
+    {
+        for ( size_t rank = 0 ; rank < mLevels.size() ; rank++ ) {
+            std::vector<char>().swap( mLevels[ rank ].paths );
+            std::vector<uint32_t>().swap( mLevels[ rank ].senders );
+        }
+        if ( mTraits.mDebug || mTraits.mM < 2 ) {
+            for ( int rank = 0 ; rank <= mTraits.mM ; rank++ )
+                GenerateLevel( rank );
+            return;
+        }
+        GenerateLevel( 0 );
+        GenerateLevel( 1 );
+        for ( int rank = 2 ; rank <= mTraits.mM ; rank++ )
+            Allocate( rank );
+        int first = (int) mTraits.mN - 1;
+        if ( threads > first )
+            threads = first;
+        if ( threads < 1 )
+            threads = 1;
+        std::vector<TopologyJob> jobs( threads );
+        std::vector<pthread_t> handles( threads );
+        std::vector<bool> started( threads, false );
+        for ( int t = 0 ; t < threads ; t++ ) {
+            jobs[ t ].first = t;
+            jobs[ t ].step = threads;
+            if ( t > 0 ) {
+                int error = pthread_create( &handles[ t ], 0, BuildSubtrees, &jobs[ t ] );
+                if ( error )
+                    std::cerr << "pthread_create: " << strerror( error ) << ", building inline\n";
+                else
+                    started[ t ] = true;
+            }
+        }
+        for ( int t = 0 ; t < threads ; t++ )
+            if ( !started[ t ] )
+                BuildSubtrees( &jobs[ t ] );
+        for ( int t = 1 ; t < threads ; t++ )
+            if ( started[ t ] )
+                pthread_join( handles[ t ], 0 );
+    }
+    //
+    // The Transport used when the processes all live in the same vector, and
+    // sending a message is just a method call.
+    //
+    class DirectTransport : public Transport {
+    public :
+        DirectTransport( std::vector<Process> &processes )
+            : mProcesses( processes )
+        {}
+        void Send( int, int destination, const Path &path, const Node &node )
+        {
+            mProcesses[ destination ].ReceiveMessage( path, node );
+        }
+        void Claim( int source, int destination, const Path &path, Value value )
+        {
+            mProcesses[ destination ].ReceiveClaim( source, path, value );
+        }
+    private :
+        std::vector<Process> &mProcesses;
+    };
+private :
+    int mId;                    //The integer ID of the process
+    Node mGeneral;              //The General's own node, at the empty path, for the source
+    std::vector<Node> mNodes;   //The process tree by PathIndex, once anything is written
+    NodeStore *mStore;          //Where the tree is kept instead, if anywhere
+    std::map<Path,Value> mSettled; //Nodes whose outcome is fixed at every loyal process
+    std::map<Path,Value> mShared; //Settled nodes that every loyal process knows about
+    std::map<std::pair<Path,Value>, std::vector<int> > mClaims; //Who claimed what is settled
+    int mEarlyRound;            //The round after which the root was settled, or -1
+    std::vector<bool> mFaulty;  //Processes this one has caught lying
+    size_t mFaultyCount;        //The number of entries set in mFaulty
+    size_t mIgnored;            //Messages dropped because their sender was caught lying
+    //
+    // The running count of resolved children of a node, and how many of them hold
+    // each value. There are only ever a handful of distinct values among siblings,
+    // so a short list beats a map.
+    //
+    struct Tally {
+        Tally() : resolved( 0 ), fixed( false ) {}
+        size_t resolved;
+        bool fixed;
+        std::vector<std::pair<Value,size_t> > counts;
+    };
+    bool mIncremental;          //True to resolve nodes as their messages arrive
+    std::map<Path,Tally> mTallies; //The tallies of nodes that are still open
+    size_t mReceived;           //Messages received so far
+    size_t mFixedAfter;         //Messages received when the root resolved, or 0
+    size_t mDiscarded;          //Leaves dropped because their parent was fixed
+    size_t mVisited;            //Nodes visited by the last DecideBounded()
+    typedef std::vector<std::pair<Value,size_t> > Counts;
+    std::map<Path,Counts> mCounts; //Child outputs by value, for WhatIf()
+    std::vector<uint64_t> mSums; //Subtree fingerprints by PathIndex, see Rehash()
+    //
+    // Static data shared among all process objects
+    //
+    static Traits mTraits;
+    static PathIndex mIndex;
+    static bool mMemoize;
+    static std::map<std::pair<int, uint64_t>, Value> mMemo; //Majorities by rank and fingerprint
+    static size_t mMemoHits;
+    static size_t mMemoMisses;
+    struct LevelData;
+    static std::vector<LevelData> mLevels;  //The topology, by rank, see Level()
+    //
+    // The recursive part of Decide(), for the node at the given path and index. The
+    // children of a node of rank r start at k + 1, each one a subtree of
+    // mIndex.Size( r + 1 ) nodes, in order of the process each one adds. A subtree
+    // the store has seen decided already, see NodeStore, is skipped.
+    //
+    Value Decide( Path &path, size_t k )
+    {
+        int rank = (int) path.size() - 1;
+        bool shared = mStore && mSettled.empty() && rank < mTraits.mM;
+        Value value;
+        if ( rank == mTraits.mM )
+            value = Get( k ).input_value;
+        else if ( !GetSubstitute( path, value ) ) {
+            if ( shared && mStore->IsDecided( mId, k, mIndex.Size( rank ) ) )
+                return Get( k ).output_value;
+            value = GetMajority( path, k );
+        }
+        SetOutput( k, value );
+        if ( shared )
+            mStore->Decided( mId, k, mIndex.Size( rank ) );
+        return value;
+    }
+    //
+    // The majority of the children of the node at the given path and index, each
+    // decided in turn. With memoisation on, that's only done once for each subtree
+    // content: the fingerprint from Rehash() says what the subtree holds, and a
+    // subtree that hashes the same as one already decided, in this process or any
+    // other, takes its answer without a look below. Nothing below it is written
+    // then, so a dump shows stale outputs there, as with DecideBounded().
+    //
+    // The memo is only used with nothing settled, since substitutes aren't part of
+    // the fingerprint. The fingerprints are 64 bits and aren't checked, so two
+    // different subtrees could in principle share an answer; with a handful of
+    // distinct subtree contents in a run, the odds are far below anything else that
+    // can go wrong here.
+    //
+    Value GetMajority( Path &path, size_t k )
+    {
+        int rank = (int) path.size() - 1;
+        std::pair<int, uint64_t> key;
+        bool memo = mMemoize && !mSums.empty() && mSettled.empty() && mShared.empty();
+        if ( memo ) {
+            key = std::make_pair( rank, Fingerprint( rank, mSums[ k ] ) );
+            std::map<std::pair<int, uint64_t>, Value>::const_iterator ii = mMemo.find( key );
+            if ( ii != mMemo.end() ) {
+                mMemoHits++;
+                return ii->second;
+            }
+            mMemoMisses++;
+        }
+        size_t n = mTraits.mN - rank - 1;
+        std::vector<Value> values( n );
+        for ( size_t i = 0, id = 0 ; i < n ; id++ ) {
+            char c = static_cast<char>( id + '0' );
+            if ( path.find( c ) != Path::npos )
+                continue;
+            path += c;
+            values[ i ] = Decide( path, k + 1 + i * mIndex.Size( rank + 1 ) );
+            path.erase( path.size() - 1 );
+            i++;
+        }
+        Value value = Majority( &values[ 0 ], n );
+        if ( memo )
+            mMemo[ key ] = value;
+        return value;
+    }
+    //
+    // Keeps the subtree fingerprints up to date when a leaf is stored. Each node has
+    // the sum of its children's fingerprints in mSums, and a leaf its own, so a
+    // node's fingerprint only depends on what is below it, not on where it is or in
+    // which order its children come - Majority() doesn't care about that either. A
+    // new leaf changes one child of each of its ancestors, so that's M steps up.
+    //
+    // Everything is offset so that a node nobody wrote to has a fingerprint of 0,
+    // which lets mSums start out zeroed, the same as reading FAULTY from the tree.
+    //
+    void Rehash( const Path &path, size_t k, Value value )
+    {
+        if ( !mMemoize || path.size() != (size_t) mTraits.mM + 1 )
+            return;
+        if ( mSums.empty() )
+            mSums.resize( mIndex.Size( 0 ) );
+        size_t ancestors[ 64 ];
+        mIndex( path, ancestors );
+        uint64_t before = mSums[ k ];
+        uint64_t after = Mix( value ) - Mix( FAULTY );
+        mSums[ k ] = after;
+        for ( int rank = mTraits.mM - 1 ; rank >= 0 && before != after ; rank-- ) {
+            uint64_t &sum = mSums[ ancestors[ rank ] ];
+            uint64_t old = Fingerprint( rank, sum );
+            sum += after - before;
+            before = old;
+            after = Fingerprint( rank, sum );
         }
-        const Path &top_path = mPathsByRank[ 0 ][ mTraits.mSource ].front();
-        const Node &top_node = mNodes[ top_path ];
-        return top_node.output_value;
     }
+    static uint64_t Fingerprint( int rank, uint64_t sum )
+    {
+        uint64_t salt = (uint64_t) ( rank + 1 ) << 32;
+        return Mix( sum ^ salt ) - Mix( salt );
+    }
+    //
+    // The finaliser of splitmix64, which spreads every bit of its input over the
+    // whole result
+    //
+    static uint64_t Mix( uint64_t x )
+    {
+        x = ( x ^ ( x >> 30 ) ) * ( ( (uint64_t) 0xbf58476du << 32 ) | 0x1ce4e5b9u );
+        x = ( x ^ ( x >> 27 ) ) * ( ( (uint64_t) 0x94d049bbu << 32 ) | 0x133111ebu );
+        return x ^ ( x >> 31 );
+    }
+    //
+    // The node at the given PathIndex, from the store if there is one. Nodes past
+    // the end of mNodes were never written.
+    //
+    Node Get( size_t k ) const
+    {
+        if ( mStore )
+            return mStore->Get( mId, k );
+        return k < mNodes.size() ? mNodes[ k ] : Node();
+    }
+    void SetInput( size_t k, Value value )
+    {
+        if ( mStore )
+            mStore->SetInput( mId, k, value );
+        else
+            Dense( k ).input_value = value;
+    }
+    void SetOutput( size_t k, Value value )
+    {
+        if ( mStore )
+            mStore->SetOutput( mId, k, value );
+        else
+            Dense( k ).output_value = value;
+    }
+    Node &Dense( size_t k )
+    {
+        if ( mNodes.empty() )
+            mNodes.resize( mIndex.Size( 0 ) );
+        return mNodes[ k ];
+    }
+    //
+    // Decide() for a tree that is only in a NodeStore, by any index with a Size()
+    //
+    template <class Index>
+    static Value DecideStored( int id, NodeStore &store, const Index &index, size_t k, int rank )
+    {
+        Value value;
+        if ( rank == mTraits.mM )
+            value = store.Get( id, k ).input_value;
+        else if ( store.IsDecided( id, k, index.Size( rank ) ) )
+            return store.Get( id, k ).output_value;
+        else {
+            size_t n = mTraits.mN - rank - 1;
+            std::vector<Value> values( n );
+            for ( size_t i = 0 ; i < n ; i++ )
+                values[ i ] = DecideStored( id, store, index, k + 1 + i * index.Size( rank + 1 ), rank + 1 );
+            value = Majority( &values[ 0 ], n );
+        }
+        store.SetOutput( id, k, value );
+        if ( rank < mTraits.mM )
+            store.Decided( id, k, index.Size( rank ) );
+        return value;
+    }
+    //
+    // The counts of a node's child outputs, made from the tree if they aren't there yet
+    //
+    Counts &CountsFor( const Path &path )
+    {
+        std::map<Path,Counts>::iterator ii = mCounts.find( path );
+        if ( ii != mCounts.end() )
+            return ii->second;
+        Counts &counts = mCounts[ path ];
+        size_t k = mIndex( path );
+        size_t stride = mIndex.Size( path.size() );
+        for ( size_t i = 0 ; i < mTraits.mN - path.size() ; i++ )
+            Count( counts, Get( k + 1 + i * stride ).output_value, 1 );
+        return counts;
+    }
+    static size_t Count( Counts &counts, Value value, int delta )
+    {
+        for ( size_t i = 0 ; i < counts.size() ; i++ )
+            if ( counts[ i ].first == value )
+                return counts[ i ].second += delta;
+        counts.push_back( std::make_pair( value, (size_t) delta ) );
+        return counts.back().second;
+    }
+    //
+    // The recursive part of DecideDepthFirst(). On entry, held[ d ] has what every
+    // process received for the path, where d is its rank. Each child is a process
+    // that isn't on the path yet, and relays what it holds to everyone else.
+    //
+    static Value DepthFirst( int id,
+                             Path &path,
+                             std::vector<std::vector<Value> > &held,
+                             std::vector<std::vector<Value> > &outputs )
+    {
+        size_t d = path.size() - 1;
+        if ( d == (size_t) mTraits.mM )
+            return held[ d ][ id ];
+        std::vector<Value> &values = outputs[ d ];
+        values.clear();
+        for ( size_t c = 0 ; c < mTraits.mN ; c++ ) {
+            char child = static_cast<char>( c + '0' );
+            if ( path.find( child ) != Path::npos )
+                continue;
+            path += child;
+            for ( size_t x = 0 ; x < mTraits.mN ; x++ )
+                held[ d + 1 ][ x ] = mTraits.GetValue( held[ d ][ c ], (int) c, (int) x, path );
+            Value value = DepthFirst( id, path, held, outputs );
+            values.push_back( value );
+            path.erase( path.size() - 1 );
+        }
+        return Majority( &values[ 0 ], values.size() );
+    }
+    //
+    // The recursive part of DecideBounded(). Settled nodes take their substitute,
+    // as they do in Decide(), and then it's the saturating majority described above.
+    //
+    // The children's values are counted as they come in, the same way Resolve()
+    // does. Besides stopping when the leader has more than half, we stop when no
+    // value can even reach half any more. That rules out an even split as well, so
+    // Majority() could only say UNKNOWN. Vector consensus falls back to a majority
+    // per flag, which needs every child, so it doesn't stop that way.
+    //
+    // The children are found by index the same way as in Decide().
+    //
+    Value Evaluate( Path &path, size_t k )
+    {
+        mVisited++;
+        int rank = (int) path.size() - 1;
+        Value value;
+        if ( rank == mTraits.mM )
+            value = Get( k ).input_value;
+        else if ( !GetSubstitute( path, value ) ) {
+            size_t n = mTraits.mN - rank - 1;
+            std::vector<Value> values( n );
+            Counts counts;
+            size_t leader = 0;
+            size_t i = 0;
+            value = UNKNOWN;
+            for ( size_t id = 0 ; i < n ; id++ ) {
+                char c = static_cast<char>( id + '0' );
+                if ( path.find( c ) != Path::npos )
+                    continue;
+                path += c;
+                Value child = Evaluate( path, k + 1 + i * mIndex.Size( rank + 1 ) );
+                path.erase( path.size() - 1 );
+                values[ i++ ] = child;
+                size_t count = Count( counts, child, 1 );
+                leader = std::max( leader, count );
+                if ( count > n / 2 ) {
+                    if ( ValueTable::IsProper( child ) )
+                        value = child;
+                    break;
+                }
+                if ( leader + n - i <= n / 2 && !mTraits.mBits )
+                    break;
+            }
+            if ( i == n && leader <= n / 2 )
+                value = Majority( &values[ 0 ], n );
+        }
+        SetOutput( k, value );
+        return value;
+    }
+    //
+    // Sets the output of a node that has just resolved, and counts it towards its
+    // parent, resolving that too if the parent's outcome is now fixed.
+    //
+    void Resolve( const Path &path, Value value )
+    {
+        SetOutput( mIndex( path ), value );
+        if ( path.size() == 1 ) {
+            mFixedAfter = mReceived;
+            return;
+        }
+        Path parent = path.substr( 0, path.size() - 1 );
+        Tally &tally = mTallies[ parent ];
+        if ( tally.fixed )
+            return;
+        tally.resolved++;
+        size_t count = 0;
+        for ( size_t i = 0 ; i < tally.counts.size() && !count ; i++ )
+            if ( tally.counts[ i ].first == value )
+                count = ++tally.counts[ i ].second;
+        if ( !count )
+            tally.counts.push_back( std::make_pair( value, count = 1 ) );
+        size_t n = Children( parent ).size();
+        if ( count > n / 2 )
+            value = ValueTable::IsProper( value ) ? value : UNKNOWN;
+        else if ( tally.resolved == n )
+            value = GetMajority( parent );
+        else
+            return;
+        tally.fixed = true;
+        tally.counts.clear();
+        Resolve( parent, value );
+    }
+    //
+    // This routine calculates the majority value for the children of a given
+    // path. It gathers up the output values of the children and hands them
+    // to Majority(), below.
+    //
+    Value GetMajority( const Path &path )
+    {
+        size_t n = mTraits.mN - path.size();
+        size_t k = mIndex( path );
+        size_t stride = mIndex.Size( path.size() );
+        std::vector<Value> values( n );
+        for ( size_t i = 0 ; i < n ; i++ )
+            values[ i ] = Get( k + 1 + i * stride ).output_value;
+        return Majority( &values[ 0 ], n );
+    }
+    //
+    // The majority kernel. If there is a clearcut majority, we return that. If two
+    // proper values split the vote evenly, we return the default value defined by
+    // the Traits class. Otherwise the result is UNKNOWN.
+    //
+    // The value domain can be huge, so rather than keeping a count per value, we
+    // use the Boyer-Moore vote: one pass to find the only possible majority
+    // candidate, and a second to check that it really has more than half the votes.
+    // That settles almost every node. Only when it fails do we sort the values, which
+    // is cheap for a handful of children, and look for an even split.
+    //
+    // For vector consensus, a failed vote means the children disagree on at least
+    // one flag, and we fall back to a majority for each flag - see BitMajority().
+    //
+    static Value Majority( const Value *values, size_t n )
+    {
+        Value candidate = UNKNOWN;
+        size_t votes = 0;
+        for ( size_t i = 0 ; i < n ; i++ ) {
+            if ( votes == 0 )
+                candidate = values[ i ];
+            if ( values[ i ] == candidate )
+                votes++;
+            else
+                votes--;
+        }
+        size_t count = 0;
+        for ( size_t i = 0 ; i < n ; i++ )
+            if ( values[ i ] == candidate )
+                count++;
+        if ( count > ( n / 2 ) )
+            return ValueTable::IsProper( candidate ) ? candidate : UNKNOWN;
+        if ( mTraits.mBits )
+            return BitMajority( values, n );
+        std::vector<Value> sorted( values, values + n );
+        std::sort( sorted.begin(), sorted.end() );
+        size_t splits = 0;
+        for ( size_t i = 0 ; i < n ; ) {
+            size_t j = i;
+            while ( j < n && sorted[ j ] == sorted[ i ] )
+                j++;
+            if ( j - i == ( n / 2 ) && ValueTable::IsProper( sorted[ i ] ) )
+                splits++;
+            i = j;
+        }
+        if ( splits >= 2 )
+            return mTraits.GetDefault();
+        return UNKNOWN;
+    }
+    //
+    // The per-flag majority for vector consensus. Each flag is decided on its own: a
+    // one if more than half the children have it set, a zero if more than half have
+    // it clear, and otherwise the corresponding flag of the default value. Children
+    // that don't hold a flag vector at all count for neither.
+    //
+    // Rather than walking the flags one at a time, we count 64 of them at once. Each
+    // word of the vector gets a bit-sliced counter: plane k holds bit k of the count
+    // for every flag in the word, and adding a child's word is a ripple-carry add
+    // across the planes. The threshold tests are then bit-sliced compares against
+    // a constant, again 64 flags per instruction.
+    //
+    static Value BitMajority( const Value *values, size_t n )
+    {
+        size_t bits = mTraits.mBits;
+        size_t words = ( bits + 63 ) / 64;
+        Value fallback = mTraits.GetDefault();
+        size_t planes = 1;
+        while ( ( (size_t) 1 << planes ) <= n )
+            planes++;
+        size_t m = 0;
+        for ( size_t i = 0 ; i < n ; i++ )
+            if ( ValueTable::Bits( values[ i ] ) == bits )
+                m++;
+        std::vector<uint64_t> result( words );
+        std::vector<uint64_t> count( planes );
+        for ( size_t w = 0 ; w < words ; w++ ) {
+            std::fill( count.begin(), count.end(), 0 );
+            for ( size_t i = 0 ; i < n ; i++ ) {
+                if ( ValueTable::Bits( values[ i ] ) != bits )
+                    continue;
+                uint64_t carry = ValueTable::Word( values[ i ], w );
+                for ( size_t k = 0 ; k < planes && carry ; k++ ) {
+                    uint64_t next = count[ k ] & carry;
+                    count[ k ] ^= carry;
+                    carry = next;
+                }
+            }
+            //
+            // ones: count > n/2, zeros: count < m - n/2
+            //
+            uint64_t ones = 0;
+            uint64_t zeros = 0;
+            uint64_t equal = ~(uint64_t) 0;
+            for ( size_t k = planes ; k-- > 0 ; ) {
+                if ( ( ( n / 2 ) >> k ) & 1 )
+                    equal &= count[ k ];
+                else {
+                    ones |= equal & count[ k ];
+                    equal &= ~count[ k ];
+                }
+            }
+            if ( m > n / 2 ) {
+                size_t limit = m - n / 2;
+                equal = ~(uint64_t) 0;
+                for ( size_t k = planes ; k-- > 0 ; ) {
+                    if ( ( limit >> k ) & 1 ) {
+                        zeros |= equal & ~count[ k ];
+                        equal &= count[ k ];
+                    } else
+                        equal &= ~count[ k ];
+                }
+            }
+            uint64_t defaults = ValueTable::Bits( fallback ) == bits ? ValueTable::Word( fallback, w ) : 0;
+            result[ w ] = ones | ( defaults & ~( ones | zeros ) );
+        }
+        return ValueTable::InternBits( result, bits );
+    }
+    //
+    // Applies the two rules described above FindSettled() to a single node. Children
+    // that are already settled count toward rule 2 whether we found them ourselves
+    // or were convinced by the claims of others.
+    //
+    bool IsSettled( const Path &path, Value &value )
+    {
+        if ( GetSubstitute( path, value ) )
+            return true;
+        std::map<Value,size_t> inputs;
+        std::map<Value,size_t> counts;
+        size_t n = Children( path ).size();
+        for ( size_t i = 0 ; i < n ; i++ ) {
+            const Path &child = Children( path )[ i ];
+            Node node;
+            Value child_value;
+            if ( FindNode( child, node ) && ValueTable::IsProper( node.input_value ) )
+                inputs[ node.input_value ]++;
+            if ( GetSubstitute( child, child_value ) )
+                counts[ child_value ]++;
+        }
+        size_t quorum = n + 2 * mTraits.mM;
+        std::map<Value,size_t>::const_iterator jj;
+        for ( jj = inputs.begin() ; jj != inputs.end() ; jj++ )
+            if ( 2 * jj->second + 2 > quorum ) {
+                value = jj->first;
+                return true;
+            }
+        for ( jj = counts.begin() ; jj != counts.end() ; jj++ )
+            if ( jj->second > ( n / 2 ) && ValueTable::IsProper( jj->first ) ) {
+                value = jj->first;
+                return true;
+            }
+        return false;
+    }
+    //
+    // Some nodes don't need a majority, because every loyal process already knows what
+    // they should resolve to: settled nodes resolve to their settled value.
+    //
+    bool GetSubstitute( const Path &path, Value &value )
+    {
+        std::map<Path,Value>::const_iterator ii = mSettled.find( path );
+        if ( ii != mSettled.end() ) {
+            value = ii->second;
+            return true;
+        }
+        return false;
+    }
+    //
+    // A path is pruned if every loyal process is known to have settled one of its
+    // ancestors (see AdoptSettled()). The path itself may be settled without being
+    // pruned - it still needs to report its value.
+    //
+    bool IsPruned( const Path &path )
+    {
+        if ( mShared.empty() )
+            return false;
+        for ( size_t i = 1 ; i < path.size() ; i++ )
+            if ( mShared.count( path.substr( 0, i ) ) )
+                return true;
+        return false;
+    }
+    //
+    // Remembers the first round after which the root was settled.
+    //
+    void NoteEarlyRound( int round )
+    {
+        if ( mEarlyRound < 0 && mSettled.count( RootPath() ) )
+            mEarlyRound = round;
+    }
+    //
+    // The topology of the message tree is kept in one LevelData per rank. The paths
+    // of a level are all the same length, rank + 1, so they are stored back to back
+    // in lexicographic order in a single buffer, and a path is known by its position
+    // there: path p starts at p * ( rank + 1 ). Every node of a rank has the same
+    // number of children, so the children of path p are the N - rank - 1 paths of the
+    // next level from p * ( N - rank - 1 ) on, and need no table of their own.
+    //
+    // mSenders has the positions of the paths each process sends, grouped by sender in
+    // order of ID. Every sender but the source sends the same number of paths in a
+    // round, so each one's block is at a fixed offset, see Block().
+    //
+    // Both buffers are sized from PathCount() before anything is written, and nothing
+    // is ever appended. Rather than building the whole tree up front, the levels are
+    // generated as they are asked for: Level() makes sure that the level is there,
+    // and Children() makes sure that the level holding a node's children is.
+    //
+    struct LevelData {
+        std::vector<char> paths;        //The paths, rank + 1 characters each, in order
+        std::vector<uint32_t> senders;  //Their positions, grouped by sender
+    };
+    static PathList Level( size_t rank, size_t sender )
+    {
+        LevelData &level = mLevels[ rank ];
+        if ( level.paths.empty() )
+            GenerateLevel( rank );
+        return PathList( &level.paths[ 0 ], rank + 1, &level.senders[ Block( rank, sender ) ],
+                         0, Share( rank, sender ) );
+    }
+    static PathList Children( const Path &path )
+    {
+        size_t rank = path.size();
+        if ( rank > (size_t) mTraits.mM )
+            return PathList();
+        LevelData &level = mLevels[ rank ];
+        if ( level.paths.empty() )
+            GenerateLevel( rank );
+        size_t n = mTraits.mN - rank;
+        return PathList( &level.paths[ 0 ], rank + 1, 0, Position( path ) * n, n );
+    }
+    //
+    // The position of a path in its level. Each step down has one process fewer to
+    // choose from, so that's a mixed radix number, where each digit says how many of
+    // the processes not on the path yet come before the one the step adds.
+    //
+    static size_t Position( const Path &path )
+    {
+        size_t position = 0;
+        uint64_t used = (uint64_t) 1 << ( path[ 0 ] - '0' );
+        for ( size_t k = 1 ; k < path.size() ; k++ ) {
+            int id = path[ k ] - '0';
+            position = position * ( mTraits.mN - k ) + id - Ones( used & ( ( (uint64_t) 1 << id ) - 1 ) );
+            used |= (uint64_t) 1 << id;
+        }
+        return position;
+    }
+    static size_t Ones( uint64_t bits )
+    {
+        size_t count = 0;
+        for ( ; bits ; bits &= bits - 1 )
+            count++;
+        return count;
+    }
+    //
+    // The number of paths the given process sends in a round, and where they are in
+    // mSenders. Only the source sends in round 0.
+    //
+    static size_t Share( size_t rank, size_t sender )
+    {
+        if ( rank == 0 )
+            return sender == (size_t) mTraits.mSource ? 1 : 0;
+        return sender == (size_t) mTraits.mSource ? 0 : PathCount( (int) rank ) / ( mTraits.mN - 1 );
+    }
+    static size_t Block( size_t rank, size_t sender )
+    {
+        if ( rank == 0 || sender == (size_t) mTraits.mSource )
+            return 0;
+        return ( sender < (size_t) mTraits.mSource ? sender : sender - 1 ) * Share( rank, sender );
+    }
+    //
+    // Generates a level in one go, allocating it first.
+    //
+    // This routine has some debug output that is useful in debugging. If traits
+    // object has the debug member set, it will be printed out
+    //
+    static void GenerateLevel( size_t rank )
+    {
+        Allocate( rank );
+        std::vector<size_t> next( mTraits.mN, 0 );
+        FillLevel( rank, 0, PathCount( (int) rank ), next );
+        if ( !mTraits.mDebug || rank == 0 )
+            return;
+        size_t n = mTraits.mN - rank;
+        const LevelData &level = mLevels[ rank ];
+        for ( size_t p = 0 ; p < level.paths.size() ; p += n * ( rank + 1 ) ) {
+            std::cout << Path( &level.paths[ p ], rank ) << ", children = ";
+            for ( size_t j = 0 ; j < n ; j++ )
+                std::cout << Path( &level.paths[ p + j * ( rank + 1 ) ], rank + 1 ) << " ";
+            std::cout << "\n";
+        }
+        if ( rank == (size_t) mTraits.mM )
+            for ( size_t p = 0 ; p < level.paths.size() ; p += rank + 1 )
+                std::cout << Path( &level.paths[ p ], rank + 1 ) << ", children = \n";
+    }
+    static void Allocate( size_t rank )
+    {
+        mLevels[ rank ].paths.resize( PathCount( (int) rank ) * ( rank + 1 ) );
+        mLevels[ rank ].senders.resize( PathCount( (int) rank ) );
+    }
+    //
+    // Writes the paths from position begin up to end of a level, and their positions
+    // into the blocks of their senders, from next[ sender ] on in each. The first path
+    // is worked out from its position, with the digits of Position(), and the rest
+    // are counted up from there like an odometer, the last digit first. That keeps
+    // them in lexicographic order, so the paths of each sender come out in order too.
+    //
+    // No two calls that write different positions of the same level touch the same
+    // memory, which is what lets BuildTopology() fill a level from several threads.
+    //
+    static void FillLevel( size_t rank, size_t begin, size_t end, std::vector<size_t> &next )
+    {
+        LevelData &level = mLevels[ rank ];
+        Path path( rank + 1, static_cast<char>( mTraits.mSource + '0' ) );
+        std::vector<size_t> digits( rank + 1, 0 );
+        for ( size_t k = rank, p = begin ; k > 0 ; k-- ) {
+            digits[ k ] = p % ( mTraits.mN - k );
+            p /= mTraits.mN - k;
+        }
+        SetDigits( path, digits, 1 );
+        for ( size_t p = begin ; p < end ; p++ ) {
+            memcpy( &level.paths[ p * ( rank + 1 ) ], path.data(), rank + 1 );
+            size_t sender = path[ rank ] - '0';
+            level.senders[ Block( rank, sender ) + next[ sender ]++ ] = (uint32_t) p;
+            size_t k = rank;
+            while ( k > 0 && ++digits[ k ] == mTraits.mN - k )
+                digits[ k-- ] = 0;
+            if ( k > 0 )
+                SetDigits( path, digits, k );
+        }
+    }
+    //
+    // Rewrites the path from step k on to match the digits
+    //
+    static void SetDigits( Path &path, const std::vector<size_t> &digits, size_t k )
+    {
+        uint64_t used = 0;
+        for ( size_t i = 0 ; i < k ; i++ )
+            used |= (uint64_t) 1 << ( path[ i ] - '0' );
+        for ( ; k < path.size() ; k++ ) {
+            int id = 0;
+            for ( size_t skip = digits[ k ] ; ( used >> id ) & 1 || skip-- > 0 ; )
+                id++;
+            path[ k ] = static_cast<char>( id + '0' );
+            used |= (uint64_t) 1 << id;
+        }
+    }
+    //
+    // One thread's share of BuildTopology(): the first level nodes first, first +
+    // step, and so on.
+    //
+    struct TopologyJob {
+        size_t first;
+        size_t step;
+    };
+    //
+    // Fills in the subtrees of a TopologyJob. The subtree of first level node c holds
+    // the c'th of N - 1 equal runs of every level below it, and within that run, each
+    // process sends as many paths as it does below any other first level node but its
+    // own. So where its paths go in each sender's block is known too.
+    //
+    static void *BuildSubtrees( void *arg )
+    {
+        const TopologyJob &job = *static_cast<TopologyJob *>( arg );
+        const size_t n = mTraits.mN;
+        for ( size_t c = job.first ; c < n - 1 ; c += job.step )
+            for ( size_t rank = 2 ; rank <= (size_t) mTraits.mM ; rank++ ) {
+                size_t run = PathCount( (int) rank ) / ( n - 1 );
+                std::vector<size_t> next( n );
+                for ( size_t id = 0 ; id < n ; id++ ) {
+                    size_t slot = id < (size_t) mTraits.mSource ? id : id - 1;
+                    next[ id ] = ( c - ( slot < c ? 1 : 0 ) ) * ( run / ( n - 2 ) );
+                }
+                FillLevel( rank, c * run, ( c + 1 ) * run, next );
+            }
+        return 0;
+    }
+};
+
+//
+// The Pipeline runs a stream of agreements back to back, overlapping their rounds.
+// While instance k is in round 1, instance k+1 is already in round 0, and so on, so
+// once the pipeline fills up one agreement finishes every round instead of one
+// every M+1 rounds.
+//
+// Instances never share messages, so each one needs its own node storage. The
+// Pipeline keeps M+1 slots, each a full set of processes, and an instance uses slot
+// k % (M+1). Instance k finishes in the same round that instance k+M+1 needs its
+// slot, so the memory used is bounded no matter how many instances go through.
+// The topology is static, so all the slots share it.
+//
+class Pipeline {
+public :
+    Pipeline( int n, int m )
+        : mN( n )
+        , mM( m )
+        , mSlots( m + 1 )
+        , mStart( m + 1, -1 )
+        , mInstance( m + 1, 0 )
+    {
+        for ( int i = 0 ; i <= m ; i++ )
+            for ( int j = 0 ; j < n ; j++ )
+                mSlots[ i ].push_back( Process( j ) );
+    }
+    //
+    // Runs the given number of instances through the pipeline and returns the number
+    // of rounds it took. When an instance finishes, the decisions of its loyal
+    // processes are stored in mDecisions, with UNKNOWN standing in for faulty ones.
+    //
+    int Run( int instances )
+    {
+        int started = 0;
+        int finished = 0;
+        int round = 0;
+        mDecisions.assign( instances, std::vector<Value>( mN, UNKNOWN ) );
+        for ( ; finished < instances ; round++ ) {
+            int slot = round % ( mM + 1 );
+            if ( started < instances ) {
+                for ( int j = 0 ; j < mN ; j++ )
+                    mSlots[ slot ][ j ].Reset();
+                mStart[ slot ] = round;
+                mInstance[ slot ] = started++;
+            }
+            for ( int i = 0 ; i <= mM ; i++ ) {
+                if ( mStart[ i ] < 0 )
+                    continue;
+                std::vector<Process> &processes = mSlots[ i ];
+                int stage = round - mStart[ i ];
+                for ( int j = 0 ; j < mN ; j++ )
+                    processes[ j ].SendMessages( stage, processes );
+                if ( stage == mM ) {
+                    for ( int j = 0 ; j < mN ; j++ )
+                        if ( !processes[ j ].IsFaulty() )
+                            mDecisions[ mInstance[ i ] ][ j ] = processes[ j ].Decide();
+                    mStart[ i ] = -1;
+                    finished++;
+                }
+            }
+        }
+        return round;
+    }
+    std::vector<std::vector<Value> > mDecisions;
+private :
+    int mN;
+    int mM;
+    std::vector<std::vector<Process> > mSlots; //One set of processes per instance in flight
+    std::vector<int> mStart;                   //The round each slot's instance started, or -1
+    std::vector<int> mInstance;                //The instance number in each slot
+};
+
+//
+// Interactive consistency: every general is a source, and the loyal ones all have
+// to end up with the same vector of everybody's values, with the right value for
+// every loyal general. That takes N instances of the protocol, one per source,
+// and this runs them side by side.
+//
+// The topology for source s is the canonical one, where SOURCE is the source,
+// with processes SOURCE and s swapped. So in instance s, real process p plays the
+// part of canonical process Role( s, p ), and since a swap is its own inverse,
+// Role() takes canonical IDs back to real ones just the same. All the instances
+// share the one static topology that way, each with its own set of canonical
+// Process objects for its trees.
+//
+// Faults belong to the real processes, so what a relay sends is worked out with
+// real IDs. In each round the messages of all instances from one real process to
+// another are gathered into a single batch, as they would be on the wire between
+// the two, and only then delivered.
+//
+class InteractiveConsistency {
+public :
+    InteractiveConsistency( int n, int m, int source )
+        : mN( n )
+        , mM( m )
+        , mSource( source )
+        , mInstances( n )
+        , mMessages( 0 )
+        , mBatches( 0 )
+    {
+        for ( int s = 0 ; s < n ; s++ )
+            for ( int c = 0 ; c < n ; c++ )
+                mInstances[ s ].push_back( Process( c ) );
+    }
+    void Run()
+    {
+        for ( int round = 0 ; round <= mM ; round++ )
+            Round( round );
+    }
+    //
+    // The vector real process p decides on, one entry per source. A process doesn't
+    // need to decide on its own value.
+    //
+    std::vector<Value> Decide( int p )
+    {
+        std::vector<Value> values( mN );
+        for ( int s = 0 ; s < mN ; s++ )
+            values[ s ] = s == p ? Process::Proposal( s ) : mInstances[ s ][ Role( s, p ) ].Decide();
+        return values;
+    }
+    size_t Messages()
+    {
+        return mMessages;
+    }
+    size_t Batches()
+    {
+        return mBatches;
+    }
+private :
+    struct Message {
+        Message( int instance, const Path &path, Value value )
+            : instance( instance )
+            , path( path )
+            , value( value )
+        {}
+        int instance;
+        Path path;
+        Value value;
+    };
+    int Role( int s, int id )
+    {
+        return id == s ? mSource : id == mSource ? s : id;
+    }
+    void Round( int round )
+    {
+        std::vector<std::vector<Message> > batches( mN * mN );
+        for ( int s = 0 ; s < mN ; s++ )
+            for ( int c = 0 ; c < mN ; c++ ) {
+                Process::PathList paths = Process::PathsFor( round, c );
+                int sender = Role( s, c );
+                for ( size_t i = 0 ; i < paths.size() ; i++ ) {
+                    Path path = paths[ i ];
+                    Value value = Process::Proposal( s );
+                    Node parent;
+                    if ( round > 0 && mInstances[ s ][ c ].FindNode( path.substr( 0, path.size() - 1 ), parent ) )
+                        value = parent.input_value;
+                    for ( int d = 0 ; d < mN ; d++ )
+                        if ( d != s )
+                            batches[ sender * mN + d ].push_back(
+                                Message( s, path, Process::Relay( value, sender, d, round ) ) );
+                }
+            }
+        for ( size_t k = 0 ; k < batches.size() ; k++ ) {
+            if ( batches[ k ].empty() )
+                continue;
+            int destination = (int) k % mN;
+            for ( size_t i = 0 ; i < batches[ k ].size() ; i++ ) {
+                const Message &message = batches[ k ][ i ];
+                mInstances[ message.instance ][ Role( message.instance, destination ) ]
+                    .ReceiveMessage( message.path, Node( message.value, UNKNOWN ) );
+            }
+            mMessages += batches[ k ].size();
+            mBatches++;
+        }
+    }
+    int mN;
+    int mM;
+    int mSource;
+    std::vector<std::vector<Process> > mInstances; //The canonical processes of each instance
+    size_t mMessages;                              //Messages delivered so far
+    size_t mBatches;                               //Batches they went in
+};
+
+//
+// A ProcessTask runs one process as a resumable task instead of as a step of the big
+// loop in main(). It's a coroutine written out by hand: the state records where it
+// left off, and each call to Resume() carries on from there until the next point
+// where it has to suspend.
+//
+// The body of the task, if we had real coroutines, would be:
+//
+//     for round = 0 to M
+//         yield the messages for this round
+//         await the messages every process sends in this round
+//         if nobody sent anything, or this is round M, break
+//         if early stopping
+//             yield claims for the nodes FindSettled() finds
+//             await the claims every process sends
+//             AdoptSettled()
+//     return Decide()
+//
+// Each process yields exactly one batch per round, and one of claims, even if it is
+// empty, so a task knows a round is complete once it has seen N batches for it. The
+// batches carry how many messages went out, so every task sees the same total for a
+// round, and they all stop after the same one, as the round loop in main() does.
+//
+// A task can only get a round ahead of the others once every claim of the round
+// before it is in, so whatever it sends is what the slower ones would have sent
+// after adopting those claims too. Fault detection is still left to main().
+//
+class ProcessTask {
+public :
+    enum State {
+        SENDING,
+        AWAITING,
+        AWAITING_CLAIMS,
+        DONE
+    };
+    ProcessTask( int instance, int id, int n, int m, bool early_stopping )
+        : mProcess( id )
+        , mInstance( instance )
+        , mState( SENDING )
+        , mN( n )
+        , mRound( 0 )
+        , mEarlyStopping( early_stopping )
+        , mYielded( 0 )
+        , mArrived( m + 1, 0 )
+        , mClaimed( m + 1, 0 )
+        , mSent( m + 1, 0 )
+        , mDecision( UNKNOWN )
+        , mQueued( false )
+    {
+    }
+    //
+    // Runs the task until it suspends. The batch for the round, if any, goes out
+    // through the given Transport, and its size is left in mYielded. Returns true if
+    // a batch was yielded, in which case the caller has to tell everyone with
+    // Arrive(); mState then says which kind it was.
+    //
+    bool Resume( Transport &transport )
+    {
+        switch ( mState ) {
+        case SENDING :
+            mYielded = mProcess.SendMessages( mRound, transport );
+            mState = AWAITING;
+            return true;
+        case AWAITING :
+            if ( mArrived[ mRound ] < mN )
+                return false;
+            if ( mRound + 1 == (int) mArrived.size() || !mSent[ mRound ] ) {
+                if ( !mProcess.IsFaulty() )
+                    mDecision = mProcess.Decide();
+                mState = DONE;
+                return false;
+            }
+            if ( mEarlyStopping ) {
+                mYielded = mProcess.FindSettled( mRound, transport );
+                mState = AWAITING_CLAIMS;
+                return true;
+            }
+            mRound++;
+            mState = SENDING;
+            return Resume( transport );
+        case AWAITING_CLAIMS :
+            if ( mClaimed[ mRound ] < mN )
+                return false;
+            mProcess.AdoptSettled( mRound );
+            mRound++;
+            mState = SENDING;
+            return Resume( transport );
+        case DONE :
+            break;
+        }
+        return false;
+    }
+    //
+    // Called once for every batch yielded in the given round, with whether it was
+    // claims and how many it had. Returns true if that completes the batches this
+    // task is waiting on, so it is ready to run again.
+    //
+    bool Arrive( int round, bool claims, size_t count )
+    {
+        if ( claims ) {
+            mClaimed[ round ]++;
+            return mState == AWAITING_CLAIMS && round == mRound && mClaimed[ round ] == mN;
+        }
+        mArrived[ round ]++;
+        mSent[ round ] += count;
+        return mState == AWAITING && round == mRound && mArrived[ round ] == mN;
+    }
+    Process mProcess;
+    int mInstance;
+    State mState;
+    int mN;
+    int mRound;                   //The round being sent or awaited
+    bool mEarlyStopping;          //True to trade settle claims after each round
+    size_t mYielded;              //The size of the last batch yielded
+    std::vector<int> mArrived;    //The number of message batches seen in each round
+    std::vector<int> mClaimed;    //The number of claim batches seen in each round
+    std::vector<size_t> mSent;    //The messages in the batches seen in each round
+    Value mDecision;              //The decision, or UNKNOWN for a faulty process
+    bool mQueued;                 //True while the task is on the ready queue
+};
+
+//
+// The Executor drives any number of independent agreements, each made up of N
+// ProcessTasks, on a single thread. There is no global round loop: a task runs
+// whenever it is ready, and becomes ready when the batches it is waiting on have
+// arrived, so different instances, and different processes in the same instance,
+// are free to get ahead of each other.
+//
+// The Executor is also the Transport the tasks send through, delivering each message
+// and settle claim straight into the destination process of the instance currently
+// running.
+//
+class Executor : public Transport {
+public :
+    Executor( int n, int m, int instances, bool early_stopping = false )
+        : mN( n )
+        , mCurrent( 0 )
+        , mResumptions( 0 )
+        , mClaims( 0 )
+    {
+        for ( int i = 0 ; i < instances ; i++ ) {
+            mTasks.push_back( std::vector<ProcessTask>() );
+            for ( int j = 0 ; j < n ; j++ )
+                mTasks[ i ].push_back( ProcessTask( i, j, n, m, early_stopping ) );
+        }
+    }
+    //
+    // Runs until every task is done. The decisions of loyal processes are left in
+    // mDecisions, with UNKNOWN standing in for faulty ones.
+    //
+    void Run()
+    {
+        for ( size_t i = 0 ; i < mTasks.size() ; i++ )
+            for ( int j = 0 ; j < mN ; j++ )
+                Schedule( mTasks[ i ][ j ] );
+        while ( !mReady.empty() ) {
+            ProcessTask &task = *mReady.front();
+            mReady.pop_front();
+            task.mQueued = false;
+            mCurrent = task.mInstance;
+            mResumptions++;
+            if ( task.Resume( *this ) ) {
+                std::vector<ProcessTask> &tasks = mTasks[ task.mInstance ];
+                int round = task.mRound;
+                bool claims = task.mState == ProcessTask::AWAITING_CLAIMS;
+                if ( claims )
+                    mClaims += task.mYielded;
+                for ( int j = 0 ; j < mN ; j++ )
+                    if ( tasks[ j ].Arrive( round, claims, task.mYielded ) )
+                        Schedule( tasks[ j ] );
+            }
+        }
+        mDecisions.assign( mTasks.size(), std::vector<Value>( mN, UNKNOWN ) );
+        for ( size_t i = 0 ; i < mTasks.size() ; i++ )
+            for ( int j = 0 ; j < mN ; j++ )
+                mDecisions[ i ][ j ] = mTasks[ i ][ j ].mDecision;
+    }
+    void Send( int, int destination, const Path &path, const Node &node )
+    {
+        mTasks[ mCurrent ][ destination ].mProcess.ReceiveMessage( path, node );
+    }
+    void Claim( int source, int destination, const Path &path, Value value )
+    {
+        mTasks[ mCurrent ][ destination ].mProcess.ReceiveClaim( source, path, value );
+    }
+    //
+    // The number of times a task was resumed, a measure of the scheduling work done,
+    // and the number of settle claims sent.
+    //
+    size_t Resumptions()
+    {
+        return mResumptions;
+    }
+    size_t Claims()
+    {
+        return mClaims;
+    }
+    std::vector<std::vector<Value> > mDecisions;
+private :
+    void Schedule( ProcessTask &task )
+    {
+        if ( !task.mQueued && task.mState != ProcessTask::DONE ) {
+            task.mQueued = true;
+            mReady.push_back( &task );
+        }
+    }
+    int mN;
+    int mCurrent;                                   //The instance of the running task
+    size_t mResumptions;
+    size_t mClaims;
+    std::vector<std::vector<ProcessTask> > mTasks;  //One set of tasks per instance
+    std::deque<ProcessTask *> mReady;               //Tasks ready to run, in order
+};
+
+//
+// The NetworkSimulator is a Transport that puts a simulated network between the
+// processes, so that we can predict how long an agreement takes on a real one.
+//
+// It is a discrete-event simulator. Send() doesn't deliver anything, it works out
+// when the message would arrive and queues a delivery event. RunRound() then pops
+// the events in time order, delivers them, and returns the time the last one
+// arrived, which is when the round is complete and the next one can start.
+//
+// Every directed link has its own model. A message has to wait for the link to
+// finish transmitting whatever was queued ahead of it, then takes its size divided
+// by the link bandwidth to go out on the wire, then a propagation delay drawn
+// from the link's latency distribution. Times are in milliseconds, bandwidth in
+// bytes per millisecond (which is conveniently also kilobytes per second).
+//
+class NetworkSimulator : public Transport {
+public :
+    enum Distribution {
+        FIXED,          // always the mean
+        UNIFORM,        // mean +/- spread, but never below zero
+        EXPONENTIAL     // mean plus an exponential tail with the given spread as its mean
+    };
+    struct Link {
+        Link( double latency = 1.0, double spread = 0.0, Distribution distribution = FIXED, double bandwidth = 0 )
+            : latency( latency )
+            , spread( spread )
+            , distribution( distribution )
+            , bandwidth( bandwidth )
+            , busy_until( 0 )
+        {}
+        double latency;
+        double spread;
+        Distribution distribution;
+        double bandwidth;       //Zero means unlimited
+        double busy_until;      //When the link finishes sending what's already queued
+    };
+    //
+    // Something that wants to know when a late message was replaced, since what
+    // the receiver stored is then not what was sent.
+    //
+    class Observer {
+    public :
+        virtual ~Observer() {}
+        virtual void Replaced( int source, int destination, const Path &path, Value substitute ) = 0;
+    };
+    NetworkSimulator( std::vector<Process> &processes, const Link &link, uint64_t seed = 1 )
+        : mProcesses( processes )
+        , mLinks( processes.size() * processes.size(), link )
+        , mNow( 0 )
+        , mBytes( 0 )
+        , mLate( 0 )
+        , mRandom( seed ? seed : 1 )
+        , mObserver( 0 )
+    {}
+    void SetObserver( Observer *observer )
+    {
+        mObserver = observer;
+    }
+    //
+    // Overrides the model for the link from source to destination.
+    //
+    void SetLink( int source, int destination, const Link &link )
+    {
+        mLinks[ source * mProcesses.size() + destination ] = link;
+    }
+    void Send( int source, int destination, const Path &path, const Node &node )
+    {
+        Queue( Message( source, destination, path, node ) );
+    }
+    //
+    // Claims travel the same links as messages, and take the same room on them.
+    //
+    void Claim( int source, int destination, const Path &path, Value value )
+    {
+        Message message( source, destination, path, Node( value, UNKNOWN ) );
+        message.claim = true;
+        Queue( message );
+    }
+    //
+    // Delivers everything sent since the last call, and returns the simulated time
+    // at which the round finished.
+    //
+    double RunRound()
+    {
+        double start = mNow;
+        mLatencies.clear();
+        while ( !mEvents.empty() ) {
+            Event event = mEvents.top();
+            mEvents.pop();
+            Deliver( mMessages[ event.sequence ] );
+            mNow = std::max( mNow, event.time );
+            mLatencies.push_back( event.time - start );
+        }
+        mMessages.clear();
+        return mNow;
+    }
+    //
+    // The same, but the round ends after the given timeout whether or not everything
+    // has arrived. A message that misses the deadline is replaced by the substitute
+    // value, so the receiver still has a node to relay and decide on, and the real
+    // one is thrown away when it turns up. As far as the algorithm is concerned, a
+    // late message is one its sender failed to send, so a loyal process behind a
+    // slow link counts against M just like a faulty one: the loyal processes still
+    // agree as long as slow and faulty processes together number no more than M.
+    // Validity is another matter. If the slow process is the source, the others
+    // only have to agree among themselves, and may well not decide what it sent.
+    //
+    // Fault detection can't tell a slow process from a lying one, and a substitute
+    // is relayed on by loyal processes too, so it is turned off with deadlines.
+    //
+    // A late claim is delivered anyway. Early stopping counts on every claim getting
+    // through, and the main loop doesn't put a deadline on them in the first place.
+    //
+    // Late messages still count in the latencies, since a real receiver would see
+    // them arrive eventually, and a timeout that only learns from the messages that
+    // beat it would never grow.
+    //
+    // Each substitution is reported to the observer, if there is one.
+    //
+    double RunRound( double timeout, Value substitute )
+    {
+        double start = mNow;
+        double deadline = start + timeout;
+        mLatencies.clear();
+        while ( !mEvents.empty() ) {
+            Event event = mEvents.top();
+            mEvents.pop();
+            const Message &message = mMessages[ event.sequence ];
+            if ( event.time <= deadline || message.claim ) {
+                Deliver( message );
+                mNow = std::max( mNow, event.time );
+            } else {
+                mProcesses[ message.destination ].ReceiveMessage( message.path, Node( substitute, UNKNOWN ) );
+                if ( mObserver )
+                    mObserver->Replaced( message.source, message.destination, message.path, substitute );
+                mNow = deadline;
+                mLate++;
+            }
+            mLatencies.push_back( event.time - start );
+        }
+        mMessages.clear();
+        return mNow;
+    }
+    //
+    // How long each message of the last round took, measured from the start of the
+    // round
+    //
+    const std::vector<double> &Latencies()
+    {
+        return mLatencies;
+    }
+    //
+    // The number of messages that missed their deadline so far
+    //
+    size_t Late()
+    {
+        return mLate;
+    }
+    //
+    // Total bytes put on the wire so far
+    //
+    size_t Bytes()
+    {
+        return mBytes;
+    }
+    //
+    // The size of a message on the wire: a four byte header with the sender,
+    // destination and round, the path with a length byte, and the value. Classic
+    // values take one byte, interned ones carry their payload with a length byte.
+    //
+    static size_t MessageSize( const Path &path, const Node &node )
+    {
+        size_t size = 4 + 1 + path.size() + 1;
+        if ( node.input_value >= FIRST_INTERNED )
+            size += 1 + ValueTable::Payload( node.input_value ).size();
+        return size;
+    }
+private :
+    //
+    // Events are kept small, so the heap moves as little as possible. The message
+    // itself lives in mMessages, and the sequence number doubles as its index,
+    // which also keeps delivery order deterministic when two events tie.
+    //
+    struct Event {
+        double time;
+        uint32_t sequence;
+        bool operator<( const Event &that ) const
+        {
+            if ( time != that.time )
+                return time > that.time;
+            return sequence > that.sequence;
+        }
+    };
+    struct Message {
+        Message( int source, int destination, const Path &path, const Node &node )
+            : source( source )
+            , destination( destination )
+            , claim( false )
+            , path( path )
+            , node( node )
+        {}
+        int source;
+        int destination;
+        bool claim;             //A claim by the source rather than an ordinary message
+        Path path;
+        Node node;
+    };
+    void Queue( const Message &message )
+    {
+        Link &link = mLinks[ message.source * mProcesses.size() + message.destination ];
+        size_t size = MessageSize( message.path, message.node );
+        double sent = std::max( mNow, link.busy_until );
+        if ( link.bandwidth > 0 )
+            sent += size / link.bandwidth;
+        link.busy_until = sent;
+        Event event;
+        event.time = sent + Latency( link );
+        event.sequence = (uint32_t) mMessages.size();
+        mMessages.push_back( message );
+        mEvents.push( event );
+        mBytes += size;
+    }
+    void Deliver( const Message &message )
+    {
+        Process &process = mProcesses[ message.destination ];
+        if ( message.claim )
+            process.ReceiveClaim( message.source, message.path, message.node.input_value );
+        else
+            process.ReceiveMessage( message.path, message.node );
+    }
+    double Latency( const Link &link )
+    {
+        switch ( link.distribution ) {
+        case UNIFORM :
+            return std::max( 0.0, link.latency + link.spread * ( 2 * Uniform() - 1 ) );
+        case EXPONENTIAL :
+            return link.latency - link.spread * std::log( 1 - Uniform() );
+        default :
+            return link.latency;
+        }
+    }
+    //
+    // xorshift64*, which is plenty random for this and keeps runs repeatable
+    //
+    double Uniform()
+    {
+        mRandom ^= mRandom >> 12;
+        mRandom ^= mRandom << 25;
+        mRandom ^= mRandom >> 27;
+        uint64_t multiplier = ( (uint64_t) 0x2545f491u << 32 ) | 0x4f6cdd1du;
+        return ( ( mRandom * multiplier ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+    }
+    std::vector<Process> &mProcesses;
+    std::vector<Link> mLinks;
+    std::priority_queue<Event> mEvents;
+    std::vector<Message> mMessages;
+    double mNow;
+    size_t mBytes;
+    std::vector<double> mLatencies; //Delivery times in the last round
+    size_t mLate;
+    uint64_t mRandom;
+    Observer *mObserver;            //Told about substitutions, if set
+};
+
+//
+// The RoundTimer picks the timeout for each round from the message latencies seen
+// in earlier ones. The timeout is the given percentile of the recent latencies,
+// stretched by a safety margin, and held between a floor and a ceiling. The
+// ceiling is what bounds the length of a round, however slow the links get; the
+// floor keeps a few quick rounds from talking it down to nothing.
+//
+// Until there is anything to go on, the initial timeout is used.
+//
+class RoundTimer {
+public :
+    RoundTimer( double initial, double percentile = 0.95, double margin = 1.5,
+                double floor = 1.0, double ceiling = 1000.0, size_t window = 4096 )
+        : mInitial( initial )
+        , mPercentile( percentile )
+        , mMargin( margin )
+        , mFloor( floor )
+        , mCeiling( ceiling )
+        , mWindow( window )
+        , mNext( 0 )
+    {}
+    double Timeout()
+    {
+        if ( mSamples.empty() )
+            return mInitial;
+        std::vector<double> samples( mSamples );
+        size_t k = std::min( samples.size() - 1, (size_t) ( mPercentile * samples.size() ) );
+        std::nth_element( samples.begin(), samples.begin() + k, samples.end() );
+        return std::max( mFloor, std::min( mCeiling, samples[ k ] * mMargin ) );
+    }
+    //
+    // Adds the latencies of a round. Once the window is full, the oldest samples
+    // are overwritten, so the timeout follows the network as it changes.
+    //
+    void Observe( const std::vector<double> &latencies )
+    {
+        for ( size_t i = 0 ; i < latencies.size() ; i++ ) {
+            if ( mSamples.size() < mWindow )
+                mSamples.push_back( latencies[ i ] );
+            else
+                mSamples[ mNext ] = latencies[ i ];
+            mNext = ( mNext + 1 ) % mWindow;
+        }
+    }
+private :
+    double mInitial;
+    double mPercentile;
+    double mMargin;
+    double mFloor;
+    double mCeiling;
+    size_t mWindow;
+    size_t mNext;                   //The sample to overwrite next
+    std::vector<double> mSamples;   //The most recent latencies
+};
+
+//
+// Wire holds the binary encoding used when messages leave the address space. All
+// integers are little-endian, and lengths are LEB128 varints, so small things stay
+// small. A value is a tag byte followed by:
+//
+//   0 - nothing else, the tag is followed by the classic character value
+//   1 - a varint length and the payload bytes of an interned value
+//   2 - a varint bit count and the packed words of a bit vector
+//
+// Interned values are sent by payload rather than by handle, since every OS
+// process has its own ValueTable and the handles don't mean anything elsewhere.
+//
+class Wire {
+public :
+    static void PutVarint( std::string &out, size_t n )
+    {
+        while ( n >= 0x80 ) {
+            out += static_cast<char>( ( n & 0x7f ) | 0x80 );
+            n >>= 7;
+        }
+        out += static_cast<char>( n );
+    }
+    static size_t GetVarint( const char *&p )
+    {
+        size_t n = 0;
+        for ( int shift = 0 ; ; shift += 7 ) {
+            unsigned char c = static_cast<unsigned char>( *p++ );
+            n |= (size_t) ( c & 0x7f ) << shift;
+            if ( !( c & 0x80 ) )
+                return n;
+        }
+    }
+    static void PutValue( std::string &out, Value value )
+    {
+        if ( value < FIRST_INTERNED ) {
+            out += '\0';
+            out += static_cast<char>( value );
+        } else if ( ValueTable::Bits( value ) ) {
+            out += '\2';
+            PutVarint( out, ValueTable::Bits( value ) );
+            out += ValueTable::Payload( value );
+        } else {
+            out += '\1';
+            PutVarint( out, ValueTable::Payload( value ).size() );
+            out += ValueTable::Payload( value );
+        }
+    }
+    static Value GetValue( const char *&p )
+    {
+        char tag = *p++;
+        if ( tag == 0 )
+            return static_cast<unsigned char>( *p++ );
+        size_t n = GetVarint( p );
+        size_t bits = 0;
+        if ( tag == 2 ) {
+            bits = n;
+            n = ( bits + 63 ) / 64 * sizeof( uint64_t );
+        }
+        std::string payload( p, n );
+        p += n;
+        return ValueTable::Intern( payload, bits );
+    }
+    //
+    // A path goes out as a length byte followed by its characters.
+    //
+    static void PutPath( std::string &out, const Path &path )
+    {
+        out += static_cast<char>( path.size() );
+        out += path;
+    }
+    static Path GetPath( const char *&p )
+    {
+        size_t n = static_cast<unsigned char>( *p++ );
+        Path path( p, n );
+        p += n;
+        return path;
+    }
+    //
+    // Packs each item into the given number of bits, least significant bit first.
+    //
+    static void PutBits( std::string &out, const std::vector<uint32_t> &items, int bits )
+    {
+        if ( bits == 0 )
+            return;
+        size_t start = out.size();
+        out.append( ( items.size() * bits + 7 ) / 8, '\0' );
+        for ( size_t i = 0 ; i < items.size() ; i++ )
+            for ( int b = 0 ; b < bits ; b++ )
+                if ( ( items[ i ] >> b ) & 1 ) {
+                    size_t bit = i * bits + b;
+                    out[ start + bit / 8 ] |= static_cast<char>( 1 << ( bit % 8 ) );
+                }
+    }
+    static void GetBits( const char *&p, std::vector<uint32_t> &items, size_t count, int bits )
+    {
+        items.assign( count, 0 );
+        for ( size_t i = 0 ; i < count ; i++ )
+            for ( int b = 0 ; b < bits ; b++ ) {
+                size_t bit = i * bits + b;
+                if ( ( static_cast<unsigned char>( p[ bit / 8 ] ) >> ( bit % 8 ) ) & 1 )
+                    items[ i ] |= 1u << b;
+            }
+        p += ( count * bits + 7 ) / 8;
+    }
+    //
+    // The number of bits needed to tell n things apart.
+    //
+    static int BitsFor( size_t n )
+    {
+        int bits = 0;
+        while ( ( (size_t) 1 << bits ) < n )
+            bits++;
+        return bits;
+    }
+};
+
+//
+// A TreeWalk visits the paths of the tree iteratively, children before their parent,
+// in the order the TreeWriter writes them. Only the paths from the root down to the
+// current one are kept, so it costs no more memory for a huge tree than a small one.
+//
+class TreeWalk {
+public :
+    TreeWalk()
+    {
+        mStack.push_back( std::make_pair( Process::RootPath(), (size_t) 0 ) );
+        Descend();
+    }
+    bool Done() const
+    {
+        return mStack.empty();
+    }
+    const Path &Current() const
+    {
+        return mStack.back().first;
+    }
+    //
+    // The parent of the current path, or 0 for the root
+    //
+    const Path *Parent() const
+    {
+        return mStack.size() > 1 ? &mStack[ mStack.size() - 2 ].first : 0;
+    }
+    void Next()
+    {
+        mStack.pop_back();
+        Descend();
+    }
+private :
+    void Descend()
+    {
+        while ( !mStack.empty() ) {
+            Process::PathList children = Process::ChildrenOf( mStack.back().first );
+            if ( mStack.back().second == children.size() )
+                return;
+            Path child = children[ mStack.back().second++ ];
+            mStack.push_back( std::make_pair( child, (size_t) 0 ) );
+        }
+    }
+    std::vector<std::pair<Path, size_t> > mStack;   //The paths down to the current one
+};
+
+//
+// The TreeWriter dumps the contents of a process tree, for debugging and for post
+// mortems. The tree is walked with a TreeWalk, and the output goes through a fixed
+// size buffer straight to a file descriptor, so a huge tree costs no more memory
+// than a small one. There are three formats:
+//
+//   TEXT   - one {input,path,output} line per node. It's not too hard to read if
+//            the number of processes is not too big.
+//   DOT    - the same nodes as the edges of a graph that can be read in by the dot
+//            graphics compiler. You can then use the graphviz tool to get a nice
+//            graphical image of the tree.
+//   BINARY - the magic "BYZT", then varints for the format version, the process ID
+//            and the node count, then the input and output value of every node in
+//            the Wire encoding. Paths aren't written: every process has the same
+//            topology, so the walk order says which node is which. A TreeReader
+//            reads it back.
+//
+// Nodes that were never stored are written as FAULTY, same as an empty Node.
+//
+class TreeWriter {
+public :
+    enum Format {
+        TEXT,
+        DOT,
+        BINARY
+    };
+    TreeWriter( int fd, Format format, size_t capacity = 65536 )
+        : mFd( fd )
+        , mFormat( format )
+        , mCapacity( capacity )
+    {
+        mBuffer.reserve( capacity );
+    }
+    ~TreeWriter()
+    {
+        Flush();
+    }
+    void Write( const Process &process, int id )
+    {
+        if ( mFormat == DOT ) {
+            std::stringstream s;
+            s << "digraph byz {\n"
+              << "rankdir=LR;\n"
+              << "nodesep=.0025;\n"
+              << "label=\"Process " << id << "\";\n"
+              << "node [fontsize=8,width=.005,height=.005,shape=plaintext];\n"
+              << "edge [fontsize=8,arrowsize=0.25];\n";
+            Put( s.str() );
+        } else if ( mFormat == BINARY ) {
+            mScratch = "BYZT";
+            Wire::PutVarint( mScratch, 1 );
+            Wire::PutVarint( mScratch, id );
+            Wire::PutVarint( mScratch, Process::NodeCount() );
+            Put( mScratch );
+        }
+        for ( TreeWalk walk ; !walk.Done() ; walk.Next() ) {
+            Node node;
+            Node parent;
+            process.FindNode( walk.Current(), node );
+            if ( walk.Parent() )
+                process.FindNode( *walk.Parent(), parent );
+            WriteNode( walk.Current(), node, walk.Parent() ? &parent : 0 );
+        }
+        if ( mFormat == DOT )
+            Put( "};\n" );
+    }
+    //
+    // Writes out whatever is in the buffer
+    //
+    void Flush()
+    {
+        size_t done = 0;
+        while ( done < mBuffer.size() ) {
+            ssize_t n = write( mFd, mBuffer.data() + done, mBuffer.size() - done );
+            if ( n < 0 && errno == EINTR )
+                continue;
+            if ( n < 0 ) {
+                perror( "write" );
+                break;
+            }
+            done += n;
+        }
+        mBuffer.clear();
+    }
+private :
+    void WriteNode( const Path &path, const Node &node, const Node *parent )
+    {
+        switch ( mFormat ) {
+        case TEXT :
+            PutNode( node, path );
+            Put( "\n" );
+            break;
+        case DOT :
+            if ( path.size() == 1 )
+                Put( "General->" );
+            else {
+                Put( "\"" );
+                PutNode( *parent, path.substr( 0, path.size() - 1 ) );
+                Put( "\"->" );
+            }
+            Put( "\"" );
+            PutNode( node, path );
+            Put( "\";\n" );
+            break;
+        case BINARY :
+            mScratch.clear();
+            Wire::PutValue( mScratch, node.input_value );
+            Wire::PutValue( mScratch, node.output_value );
+            Put( mScratch );
+            break;
+        }
+    }
+    void PutNode( const Node &node, const Path &path )
+    {
+        Put( "{" );
+        Put( ValueTable::Format( node.input_value ) );
+        Put( "," );
+        Put( path );
+        Put( "," );
+        Put( ValueTable::Format( node.output_value ) );
+        Put( "}" );
+    }
+    void Put( const std::string &s )
+    {
+        if ( mBuffer.size() + s.size() > mCapacity )
+            Flush();
+        mBuffer += s;
+    }
+    int mFd;
+    Format mFormat;
+    size_t mCapacity;       //Flush before the buffer grows past this
+    std::string mBuffer;    //Output that hasn't been written yet
+    std::string mScratch;   //Where binary nodes are encoded
+};
+
+//
+// The TreeReader reads back a BINARY dump from the TreeWriter. The nodes come back in
+// the order they were written, which is the order of a TreeWalk, so Matches() can
+// line them up with the paths again and compare them with a process tree.
+//
+class TreeReader {
+public :
+    TreeReader()
+        : mId( -1 )
+    {}
+    //
+    // Reads a whole dump from the file descriptor. Returns false, with a message on
+    // cerr, if it isn't a dump of a tree of the current shape.
+    //
+    bool Read( int fd )
+    {
+        std::string data;
+        char buffer[ 65536 ];
+        for ( ; ; ) {
+            ssize_t n = read( fd, buffer, sizeof( buffer ) );
+            if ( n < 0 && errno == EINTR )
+                continue;
+            if ( n < 0 ) {
+                perror( "read" );
+                return false;
+            }
+            if ( n == 0 )
+                break;
+            data.append( buffer, n );
+        }
+        const char *p = data.data();
+        const char *end = p + data.size();
+        if ( data.size() < 4 || data.compare( 0, 4, "BYZT" ) ) {
+            std::cerr << "Not a binary tree dump\n";
+            return false;
+        }
+        p += 4;
+        size_t version = Wire::GetVarint( p );
+        mId = (int) Wire::GetVarint( p );
+        size_t count = Wire::GetVarint( p );
+        if ( version != 1 || count != Process::NodeCount() ) {
+            std::cerr << "The dump is of version " << version << " with " << count
+                      << " nodes, instead of version 1 with " << Process::NodeCount() << "\n";
+            return false;
+        }
+        mNodes.clear();
+        mNodes.reserve( count );
+        while ( mNodes.size() < count && p < end ) {
+            Value input = Wire::GetValue( p );
+            Value output = Wire::GetValue( p );
+            mNodes.push_back( Node( input, output ) );
+        }
+        if ( mNodes.size() < count || p != end ) {
+            std::cerr << "The dump is cut short or has trailing bytes\n";
+            return false;
+        }
+        return true;
+    }
+    int Id() const
+    {
+        return mId;
+    }
+    //
+    // Whether the dump has the same nodes as the given process tree
+    //
+    bool Matches( const Process &process ) const
+    {
+        size_t i = 0;
+        for ( TreeWalk walk ; !walk.Done() ; walk.Next(), i++ ) {
+            Node node;
+            process.FindNode( walk.Current(), node );
+            if ( i >= mNodes.size()
+                 || node.input_value != mNodes[ i ].input_value
+                 || node.output_value != mNodes[ i ].output_value )
+                return false;
+        }
+        return i == mNodes.size();
+    }
+private :
+    int mId;                    //The process the dump is of
+    std::vector<Node> mNodes;   //In the order they were written
+};
+
+//
+// The TraceRecorder is a Transport that sits in front of another one and records
+// every message that goes through it, so that a run can be looked at later without
+// running the scenario again. It's much cheaper than the debug output: a message is
+// one fixed size record copied into a file that is mapped into memory, and the
+// kernel writes it out whenever it likes.
+//
+// The file starts with a Header, followed by room for the given number of Records.
+// When that fills up, the recorder wraps around and overwrites the oldest ones, so
+// it can be left running and will always hold the latest messages. Paths are
+// recorded as their index in the canonical order of PathsFor(), and values as
+// ValueTable handles. When the recorder is closed, the payloads of all interned
+// values are appended in the Wire encoding, since handles mean nothing to another
+// run.
+//
+// The settle claims of early stopping are recorded too, in the same kind of record,
+// with the round they were sent after. The node claimed is recorded as its index
+// among all the paths of its rank, since the claimant isn't the one who sent it.
+// Fault detection needs nothing recorded: each process works out its findings from
+// the messages it got, so the header just says which of the two were on, and the
+// replay goes through the same steps between rounds.
+//
+// Messages are recorded as they are sent, but with round deadlines the simulator
+// replaces a late one with a substitute when it delivers it. The recorder observes
+// the simulator for that, and adds a LATE record for the message with the value that
+// was actually stored. It comes after the message it replaces, so a replay that
+// delivers the records in order ends up with what the receiver had.
+//
+class TraceRecorder : public Transport, public NetworkSimulator::Observer {
+public :
+    enum Flags {
+        SETTLE_CLAIMS = 1,      //Early stopping was on
+        FIND_FAULTY = 2         //Fault detection was on
+    };
+    enum {
+        LATE = 0xff             //The claim field of a record that replaces a late message
+    };
+    struct Header {
+        char magic[ 4 ];        //"BYZR"
+        uint32_t version;
+        uint32_t n;
+        uint32_t m;
+        uint32_t source;
+        uint32_t flags;
+        uint32_t capacity;      //The number of records there is room for
+        uint32_t count;         //The number of records written, including overwritten ones
+        uint32_t values;        //The size of the value payloads after the records
+    };
+    struct Record {
+        uint8_t round;
+        uint8_t sender;
+        uint8_t destination;
+        uint8_t claim;          //Zero for a message, LATE, or one more than the rank claimed
+        uint32_t index;         //Of the path in PathsFor( round, sender ), or among all of rank claim - 1
+        uint32_t value;
+        uint32_t time;          //Microseconds since the recorder was opened
+    };
+    TraceRecorder( const char *file, Transport &transport, int n, int m, int source, uint32_t flags = 0,
+                   size_t capacity = 1 << 20 )
+        : mTransport( transport )
+        , mCursors( n, 0 )
+        , mRound( 0 )
+    {
+        mFd = open( file, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+        mSize = sizeof( Header ) + capacity * sizeof( Record );
+        if ( mFd < 0 || ftruncate( mFd, mSize ) < 0 ) {
+            perror( file );
+            exit( 1 );
+        }
+        void *region = mmap( 0, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0 );
+        if ( region == MAP_FAILED ) {
+            perror( "mmap" );
+            exit( 1 );
+        }
+        mHeader = static_cast<Header *>( region );
+        memcpy( mHeader->magic, "BYZR", 4 );
+        mHeader->version = 3;
+        mHeader->n = n;
+        mHeader->m = m;
+        mHeader->source = source;
+        mHeader->flags = flags;
+        mHeader->capacity = (uint32_t) capacity;
+        mHeader->count = 0;
+        mHeader->values = 0;
+        mRecords = reinterpret_cast<Record *>( mHeader + 1 );
+        gettimeofday( &mStart, 0 );
+    }
+    //
+    // Unmaps the records, then appends the value payloads
+    //
+    ~TraceRecorder()
+    {
+        std::string values;
+        for ( size_t i = 0 ; i < ValueTable::Size() ; i++ )
+            Wire::PutValue( values, FIRST_INTERNED + (Value) i );
+        mHeader->values = (uint32_t) values.size();
+        munmap( mHeader, mSize );
+        if ( pwrite( mFd, values.data(), values.size(), mSize ) != (ssize_t) values.size() )
+            perror( "pwrite" );
+        close( mFd );
+    }
+    void Send( int source, int destination, const Path &path, const Node &node )
+    {
+        int round = (int) path.size() - 1;
+        size_t index = Process::PathPosition( path, mCursors[ source ] );
+        mRound = round;
+        Write( round, source, destination, 0, index, node.input_value );
+        mTransport.Send( source, destination, path, node );
+    }
+    //
+    // Claims go out between rounds, so the round of a claim's record is the round of
+    // the last message sent before it.
+    //
+    void Claim( int source, int destination, const Path &path, Value value )
+    {
+        int rank = (int) path.size() - 1;
+        int sender = path[ rank ] - '0';
+        size_t index = 0;
+        size_t cursor = 0;
+        for ( int i = 0 ; i < sender ; i++ )
+            index += Process::PathsFor( rank, i ).size();
+        index += Process::PathPosition( path, cursor );
+        Write( mRound, source, destination, rank + 1, index, value );
+        mTransport.Claim( source, destination, path, value );
+    }
+    void Replaced( int source, int destination, const Path &path, Value substitute )
+    {
+        size_t index = Process::PathPosition( path, mCursors[ source ] );
+        Write( (int) path.size() - 1, source, destination, LATE, index, substitute );
+    }
+private :
+    void Write( int round, int source, int destination, int claim, size_t index, Value value )
+    {
+        timeval now;
+        gettimeofday( &now, 0 );
+        Record &record = mRecords[ mHeader->count++ % mHeader->capacity ];
+        record.round = (uint8_t) round;
+        record.sender = (uint8_t) source;
+        record.destination = (uint8_t) destination;
+        record.claim = (uint8_t) claim;
+        record.index = (uint32_t) index;
+        record.value = value;
+        record.time = (uint32_t) ( ( now.tv_sec - mStart.tv_sec ) * 1000000 + now.tv_usec - mStart.tv_usec );
+    }
+    Transport &mTransport;          //Where the messages really go
+    int mFd;
+    size_t mSize;                   //The size of the mapping, header and records
+    Header *mHeader;
+    Record *mRecords;
+    std::vector<size_t> mCursors;   //The index of the last path each sender sent
+    int mRound;                     //The round of the last message sent
+    timeval mStart;
+};
+
+//
+// The TraceReplay reads back a file written by the TraceRecorder, and feeds the
+// messages a process received into a fresh Process object, which can then Decide()
+// or be dumped as if it had taken part in the original run. The topology has to be
+// the same as when the trace was recorded, and the trace can't have wrapped around,
+// or part of the run is missing.
+//
+// When early stopping or fault detection was on, the process goes through the same
+// steps between rounds as it did in the run, so it finds the same settled nodes and
+// faulty processes, and it gets the same claims from the others.
+//
+class TraceReplay {
+public :
+    TraceReplay( const char *file )
+        : mRegion( MAP_FAILED )
+        , mSize( 0 )
+    {
+        int fd = open( file, O_RDONLY );
+        if ( fd >= 0 ) {
+            mSize = lseek( fd, 0, SEEK_END );
+            if ( mSize >= sizeof( TraceRecorder::Header ) )
+                mRegion = mmap( 0, mSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+            close( fd );
+        }
+        if ( mRegion == MAP_FAILED ) {
+            perror( file );
+            exit( 1 );
+        }
+        mHeader = static_cast<const TraceRecorder::Header *>( mRegion );
+        mRecords = reinterpret_cast<const TraceRecorder::Record *>( mHeader + 1 );
+        size_t values = sizeof( TraceRecorder::Header ) + mHeader->capacity * sizeof( TraceRecorder::Record );
+        if ( memcmp( mHeader->magic, "BYZR", 4 ) || mHeader->version != 3 || values + mHeader->values > mSize ) {
+            std::cerr << file << " is not a trace\n";
+            exit( 1 );
+        }
+        //
+        // Interning the payloads again gives us new handles, in this run's table
+        //
+        const char *p = static_cast<const char *>( mRegion ) + values;
+        const char *end = p + mHeader->values;
+        while ( p < end )
+            mValues.push_back( Wire::GetValue( p ) );
+    }
+    ~TraceReplay()
+    {
+        munmap( mRegion, mSize );
+    }
+    //
+    // The number of messages and claims recorded, and whether all of them are still
+    // there
+    //
+    size_t Count()
+    {
+        return mHeader->count;
+    }
+    bool IsComplete()
+    {
+        return mHeader->count <= mHeader->capacity;
+    }
+    //
+    // Feeds every message sent to the given process into it, a round at a time, in
+    // the order they were sent, with the claims it got in between. The run stopped
+    // after the last round anything was sent in, and so does the replay. Returns false
+    // if the trace is for a different topology.
+    //
+    bool Replay( int id, Process &process, int n, int m, int source )
+    {
+        if ( mHeader->n != (uint32_t) n || mHeader->m != (uint32_t) m || mHeader->source != (uint32_t) source )
+            return false;
+        size_t count = std::min( mHeader->count, mHeader->capacity );
+        size_t first = mHeader->count - count;
+        int rounds = 0;
+        for ( size_t i = first ; i < first + count ; i++ ) {
+            const TraceRecorder::Record &record = mRecords[ i % mHeader->capacity ];
+            if ( !record.claim || record.claim == TraceRecorder::LATE )
+                rounds = std::max( rounds, record.round + 1 );
+        }
+        Discard discard;
+        for ( int round = 0 ; round < rounds ; round++ ) {
+            if ( !Deliver( id, process, round, false ) )
+                return false;
+            if ( round == m )
+                break;
+            if ( mHeader->flags & TraceRecorder::FIND_FAULTY )
+                process.FindFaulty( round );
+            if ( mHeader->flags & TraceRecorder::SETTLE_CLAIMS ) {
+                process.FindSettled( round, discard );
+                if ( !Deliver( id, process, round, true ) )
+                    return false;
+                process.AdoptSettled( round );
+            }
+        }
+        return true;
+    }
+private :
+    //
+    // The process's own claims went out in the run, so there's no need to send them
+    // again.
+    //
+    class Discard : public Transport {
+    public :
+        void Send( int, int, const Path &, const Node & )
+        {
+        }
+    };
+    //
+    // Feeds the process either the messages or the claims of one round that were
+    // sent to it. A LATE record counts as a message, and overwrites the one before.
+    //
+    bool Deliver( int id, Process &process, int round, bool claims )
+    {
+        size_t count = std::min( mHeader->count, mHeader->capacity );
+        size_t first = mHeader->count - count;
+        for ( size_t i = first ; i < first + count ; i++ ) {
+            const TraceRecorder::Record &record = mRecords[ i % mHeader->capacity ];
+            bool claim = record.claim != 0 && record.claim != TraceRecorder::LATE;
+            if ( record.destination != id || record.round != round || claim != claims )
+                continue;
+            Value value = record.value;
+            if ( value >= FIRST_INTERNED )
+                value = mValues.at( value - FIRST_INTERNED );
+            if ( !claims ) {
+                Process::PathList paths = Process::PathsFor( record.round, record.sender );
+                if ( record.index >= paths.size() )
+                    return false;
+                process.ReceiveMessage( paths[ record.index ], Node( value, UNKNOWN ) );
+                continue;
+            }
+            int rank = record.claim - 1;
+            size_t index = record.index;
+            uint32_t sender = 0;
+            if ( rank >= (int) mHeader->m )
+                return false;
+            while ( sender < mHeader->n && index >= Process::PathsFor( rank, sender ).size() )
+                index -= Process::PathsFor( rank, sender++ ).size();
+            if ( sender == mHeader->n )
+                return false;
+            process.ReceiveClaim( record.sender, Process::PathsFor( rank, sender )[ index ], value );
+        }
+        return true;
+    }
+    void *mRegion;
+    size_t mSize;
+    const TraceRecorder::Header *mHeader;
+    const TraceRecorder::Record *mRecords;
+    std::vector<Value> mValues;     //Handles in this run, by handle in the recorded one
+};
+
+//
+// A PeerTransport connects processes that live in separate OS processes. It is set
+// up before forking, and then each child calls Attach() with its own process, and
+// Exchange() at the end of each round to deliver that round's messages.
+//
+class PeerTransport : public Transport {
+public :
+    virtual void Attach( int id, Process *process ) = 0;
+    virtual void Exchange( int round ) = 0;
+    virtual size_t Bytes() = 0;
+};
+
+//
+// The SocketTransport lets each general run as a separate OS process, talking to
+// the others over Unix domain sockets.
+//
+// The constructor creates a full mesh of socket pairs, one per pair of processes,
+// and has to run before forking. Each child then calls Attach() with its own ID,
+// which closes the sockets belonging to everybody else.
+//
+// Messages are batched per round. Send() just remembers the message for its
+// destination, and Exchange() sends every peer one batch and reads one batch from
+// every peer. Since every process does the same, the exchange doubles as the barrier
+// between rounds. A batch on the wire is a four byte length, the round as a varint,
+// and then one of two encodings.
+//
+// The plain encoding is a message count followed by that many (path, value) records.
+//
+// The compact encoding leaves the paths out altogether. Within a round, a sender
+// sends every destination the same list of paths, PathsFor( round, sender ), in the
+// same order, so the receiver can work out each path from its position. What's left
+// is the values, and they are dictionary coded: the distinct values in the batch,
+// then an index into that dictionary for each message, packed into as few bits as
+// it takes. Loyal processes tend to relay the same value over and over, so that's
+// usually zero or one bit per message. So the batch is:
+//
+//   varint number of paths the sender has this round
+//   varint number of them actually sent - if that's fewer, a bitmap of which ones
+//   varint dictionary size, followed by the dictionary values
+//   the packed dictionary indices
+//
+class SocketTransport : public PeerTransport {
+public :
+    SocketTransport( int n, bool compact = true )
+        : mN( n )
+        , mId( -1 )
+        , mProcess( 0 )
+        , mCompact( compact )
+        , mSockets( n * n, -1 )
+        , mIndexes( n )
+        , mValues( n )
+        , mCursors( n, 0 )
+        , mBytes( 0 )
+    {
+        for ( int i = 0 ; i < n ; i++ )
+            for ( int j = i + 1 ; j < n ; j++ ) {
+                int pair[ 2 ];
+                if ( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) < 0 ) {
+                    perror( "socketpair" );
+                    exit( 1 );
+                }
+                mSockets[ i * n + j ] = pair[ 0 ];
+                mSockets[ j * n + i ] = pair[ 1 ];
+            }
+    }
+    //
+    // Called in each child after the fork. Called with an ID of -1 in the parent,
+    // which closes everything.
+    //
+    void Attach( int id, Process *process )
+    {
+        mId = id;
+        mProcess = process;
+        for ( int i = 0 ; i < mN ; i++ )
+            for ( int j = 0 ; j < mN ; j++ ) {
+                int &fd = mSockets[ i * mN + j ];
+                if ( fd < 0 )
+                    continue;
+                if ( i != id ) {
+                    close( fd );
+                    fd = -1;
+                } else
+                    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+            }
+    }
+    //
+    // Messages for each destination arrive in canonical order, so finding a path's
+    // position means moving a cursor forward, not searching.
     //
-    // This debug routine is used to dump out the contents of the tree in text form.
-    // It's not too hard to read if the number of processes is not too big.
+    void Send( int, int destination, const Path &path, const Node &node )
+    {
+        if ( destination == mId ) {
+            mProcess->ReceiveMessage( path, node );
+            return;
+        }
+        size_t index = Process::PathPosition( path, mCursors[ destination ] );
+        mIndexes[ destination ].push_back( (uint32_t) index );
+        mValues[ destination ].push_back( node.input_value );
+    }
     //
-    // It operates recursively, going through the tree and dumping the children of each
-    // node before dumping the node itself.
+    // Total bytes this process has written to its sockets.
     //
-    std::string Dump( Path path = "" )
+    size_t Bytes()
     {
-        if ( path == "" )
-            path = mPathsByRank[ 0 ][ mTraits.mSource ].front();
-        std::stringstream s;
-        for ( size_t i = 0 ; i < mChildren[ path ].size() ; i++ )
-            s << Dump( mChildren[ path ][ i ] );
-        Node &node = mNodes[ path ];
-        s << "{" << node.input_value
-          << "," << path
-          << "," << node.output_value
-          << "}\n";
-        return s.str();
+        return mBytes;
     }
     //
-    // This debug routine dumps out the contents of the tree, as above, but it prints
-    // it in a format that can be read in by the dot graphics compiler. You can then use
-    // the graphviz tool to get a nice graphical image of the tree.
+    // Sends this round's batches and receives everybody else's. The sockets are non
+    // blocking and we poll for both directions at once - if everyone wrote their
+    // batches out first, big rounds would fill the socket buffers and deadlock.
     //
-    std::string DumpDot( Path path = "" )
+    void Exchange( int round )
     {
-        bool root = false;
-        std::stringstream s;
-        if ( path == "" ) {
-            root = true;
-            path = mPathsByRank[ 0 ][ mTraits.mSource ].front();
-            s << "digraph byz {\n"
-              << "rankdir=LR;\n"
-              << "nodesep=.0025;\n"
-              << "label=\"Process " << mId << "\";\n"
-              << "node [fontsize=8,width=.005,height=.005,shape=plaintext];\n"
-              << "edge [fontsize=8,arrowsize=0.25];\n";
+        std::vector<std::string> outgoing( mN );
+        std::vector<std::string> incoming( mN );
+        std::vector<size_t> written( mN, 0 );
+        for ( int j = 0 ; j < mN ; j++ ) {
+            if ( j == mId )
+                continue;
+            std::string body;
+            Wire::PutVarint( body, round );
+            if ( mCompact )
+                EncodeCompact( body, round, j );
+            else
+                EncodePlain( body, round, j );
+            uint32_t size = (uint32_t) body.size();
+            outgoing[ j ].assign( reinterpret_cast<const char *>( &size ), sizeof( size ) );
+            outgoing[ j ] += body;
+            mBytes += outgoing[ j ].size();
+            mIndexes[ j ].clear();
+            mValues[ j ].clear();
+            mCursors[ j ] = 0;
+        }
+        for ( ; ; ) {
+            std::vector<pollfd> fds;
+            std::vector<int> peers;
+            for ( int j = 0 ; j < mN ; j++ ) {
+                if ( j == mId )
+                    continue;
+                pollfd fd;
+                fd.fd = mSockets[ mId * mN + j ];
+                fd.events = 0;
+                fd.revents = 0;
+                if ( written[ j ] < outgoing[ j ].size() )
+                    fd.events |= POLLOUT;
+                if ( !Complete( incoming[ j ] ) )
+                    fd.events |= POLLIN;
+                if ( fd.events ) {
+                    fds.push_back( fd );
+                    peers.push_back( j );
+                }
+            }
+            if ( fds.empty() )
+                break;
+            if ( poll( &fds[ 0 ], fds.size(), -1 ) < 0 && errno != EINTR ) {
+                perror( "poll" );
+                exit( 1 );
+            }
+            for ( size_t k = 0 ; k < fds.size() ; k++ ) {
+                int j = peers[ k ];
+                if ( fds[ k ].revents & POLLOUT ) {
+                    ssize_t n = write( fds[ k ].fd,
+                                       outgoing[ j ].data() + written[ j ],
+                                       outgoing[ j ].size() - written[ j ] );
+                    if ( n > 0 )
+                        written[ j ] += n;
+                }
+                if ( fds[ k ].revents & ( POLLIN | POLLHUP ) ) {
+                    //
+                    // Never read past the end of this batch - the peer may have
+                    // finished the round already, and the next batch is right behind.
+                    //
+                    char buffer[ 65536 ];
+                    size_t want = sizeof( uint32_t ) - incoming[ j ].size();
+                    if ( incoming[ j ].size() >= sizeof( uint32_t ) )
+                        want = std::min( sizeof( buffer ), Needed( incoming[ j ] ) );
+                    ssize_t n = read( fds[ k ].fd, buffer, want );
+                    if ( n == 0 ) {
+                        std::cerr << "Process " << j << " hung up\n";
+                        exit( 1 );
+                    }
+                    if ( n > 0 )
+                        incoming[ j ].append( buffer, n );
+                }
+            }
+        }
+        for ( int j = 0 ; j < mN ; j++ ) {
+            if ( j == mId )
+                continue;
+            const char *p = incoming[ j ].data() + sizeof( uint32_t );
+            size_t batch_round = Wire::GetVarint( p );
+            if ( batch_round != (size_t) round ) {
+                std::cerr << "Process " << j << " is in round " << batch_round << ", not " << round << "\n";
+                exit( 1 );
+            }
+            if ( mCompact )
+                DecodeCompact( p, round, j );
+            else
+                DecodePlain( p );
+        }
+    }
+private :
+    void EncodePlain( std::string &out, int round, int destination )
+    {
+        Process::PathList paths = Process::PathsFor( round, mId );
+        Wire::PutVarint( out, mIndexes[ destination ].size() );
+        for ( size_t i = 0 ; i < mIndexes[ destination ].size() ; i++ ) {
+            Wire::PutPath( out, paths[ mIndexes[ destination ][ i ] ] );
+            Wire::PutValue( out, mValues[ destination ][ i ] );
+        }
+    }
+    void DecodePlain( const char *&p )
+    {
+        size_t count = Wire::GetVarint( p );
+        for ( size_t i = 0 ; i < count ; i++ ) {
+            Path path = Wire::GetPath( p );
+            Value value = Wire::GetValue( p );
+            mProcess->ReceiveMessage( path, Node( value, UNKNOWN ) );
+        }
+    }
+    void EncodeCompact( std::string &out, int round, int destination )
+    {
+        const std::vector<uint32_t> &indexes = mIndexes[ destination ];
+        const std::vector<Value> &values = mValues[ destination ];
+        size_t total = Process::PathsFor( round, mId ).size();
+        Wire::PutVarint( out, total );
+        Wire::PutVarint( out, indexes.size() );
+        if ( indexes.size() < total ) {
+            std::vector<uint32_t> present( total, 0 );
+            for ( size_t i = 0 ; i < indexes.size() ; i++ )
+                present[ indexes[ i ] ] = 1;
+            Wire::PutBits( out, present, 1 );
+        }
+        std::vector<Value> dictionary;
+        std::map<Value, uint32_t> lookup;
+        std::vector<uint32_t> codes( values.size() );
+        for ( size_t i = 0 ; i < values.size() ; i++ ) {
+            std::map<Value, uint32_t>::iterator ii = lookup.find( values[ i ] );
+            if ( ii == lookup.end() ) {
+                ii = lookup.insert( std::make_pair( values[ i ], (uint32_t) dictionary.size() ) ).first;
+                dictionary.push_back( values[ i ] );
+            }
+            codes[ i ] = ii->second;
+        }
+        Wire::PutVarint( out, dictionary.size() );
+        for ( size_t i = 0 ; i < dictionary.size() ; i++ )
+            Wire::PutValue( out, dictionary[ i ] );
+        Wire::PutBits( out, codes, Wire::BitsFor( dictionary.size() ) );
+    }
+    void DecodeCompact( const char *&p, int round, int sender )
+    {
+        Process::PathList paths = Process::PathsFor( round, sender );
+        size_t total = Wire::GetVarint( p );
+        size_t count = Wire::GetVarint( p );
+        if ( total != paths.size() ) {
+            std::cerr << "Process " << sender << " has " << total << " paths, not " << paths.size() << "\n";
+            exit( 1 );
+        }
+        std::vector<uint32_t> present;
+        if ( count < total )
+            Wire::GetBits( p, present, total, 1 );
+        std::vector<Value> dictionary( Wire::GetVarint( p ) );
+        for ( size_t i = 0 ; i < dictionary.size() ; i++ )
+            dictionary[ i ] = Wire::GetValue( p );
+        std::vector<uint32_t> codes;
+        Wire::GetBits( p, codes, count, Wire::BitsFor( dictionary.size() ) );
+        size_t index = 0;
+        for ( size_t i = 0 ; i < count ; i++, index++ ) {
+            while ( !present.empty() && !present[ index ] )
+                index++;
+            mProcess->ReceiveMessage( paths[ index ], Node( dictionary[ codes[ i ] ], UNKNOWN ) );
         }
-        Node &node = mNodes[ path ];
-        for ( size_t i = 0 ; i < mChildren[ path ].size() ; i++ )
-            s << DumpDot( mChildren[ path ][ i ] );
-        if ( path.size() == 1 )
-            s << "General->";
-        else {
-            Path parent_path = path.substr( 0, path.size() - 1 );
-            Node &parent_node = mNodes[ parent_path ];
-            s << "\"{" << parent_node.input_value
-              << "," << parent_path
-              << "," << parent_node.output_value
-              << "}\"->";
-        }
-        s << "\"{" << node.input_value
-          << "," << path
-          << "," << node.output_value
-          << "}\";\n";
-        if ( root ) 
-            s << "};\n";
-        return s.str();
     }
     //
-    // A utility routine that tells whether a given process is faulty
+    // The number of bytes still missing from a partly read batch.
     //
-    bool IsFaulty()
+    static size_t Needed( const std::string &batch )
     {
-        return mTraits.IsFaulty( mId );
+        uint32_t size;
+        memcpy( &size, batch.data(), sizeof( size ) );
+        return sizeof( size ) + size - batch.size();
+    }
+    static bool Complete( const std::string &batch )
+    {
+        return batch.size() >= sizeof( uint32_t ) && Needed( batch ) == 0;
+    }
+    int mN;
+    int mId;
+    Process *mProcess;
+    bool mCompact;                              //Use the compact encoding
+    std::vector<int> mSockets;                  //mSockets[ i * N + j ] is process i's end of the i-j socket
+    std::vector<std::vector<uint32_t> > mIndexes; //Positions in PathsFor() of the messages for each destination
+    std::vector<std::vector<Value> > mValues;   //And their values
+    std::vector<size_t> mCursors;               //Where the last message for each destination was found
+    size_t mBytes;
+};
+
+//
+// The SharedMemoryTransport is for generals running as separate OS processes on the
+// same host. Instead of copying messages through sockets, every sender writes its
+// values straight into a shared mapping, and every receiver reads its slice of
+// that mapping in place.
+//
+// The layout follows the canonical path order, just like the compact wire format.
+// For each round, sender s has one slot per destination, and a slot holds one Value
+// per path in PathsFor( round, s ), in that order. Paths aren't stored at all. A
+// slot starts out FAULTY, so a path that wasn't sent reads the same as one that
+// was never received.
+//
+// There are two such buffers, used by alternate rounds, and one barrier per round.
+// A process only writes round r+2 after it gets through the barrier for round r+1,
+// and nobody gets there until they have finished reading round r, so the buffer
+// being overwritten is always free.
+//
+// The barrier is a futex in the shared mapping: the last process to arrive bumps
+// the generation and wakes everyone, the others sleep until the generation changes.
+//
+// Values are passed as ValueTable handles, which only works for values interned
+// before the fork, since every child has its own copy of the table after that. The
+// Traits interns its values up front, so the stock scenarios are fine.
+//
+// Futexes are Linux only, and so is this transport. Everything else just needs
+// POSIX.
+//
+#ifdef __linux__
+class SharedMemoryTransport : public PeerTransport {
+public :
+    SharedMemoryTransport( int n, int m )
+        : mN( n )
+        , mId( -1 )
+        , mProcess( 0 )
+        , mInterned( ValueTable::Size() )
+        , mCursors( n, 0 )
+        , mBytes( 0 )
+    {
+        size_t biggest = 0;
+        for ( int round = 0 ; round <= m ; round++ ) {
+            size_t size = 0;
+            for ( int s = 0 ; s < n ; s++ )
+                size += Process::PathsFor( round, s ).size() * n;
+            biggest = std::max( biggest, size );
+        }
+        mBufferSize = biggest;
+        mSize = sizeof( Barrier ) + 2 * mBufferSize * sizeof( Value );
+        void *region = mmap( 0, mSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+        if ( region == MAP_FAILED ) {
+            perror( "mmap" );
+            exit( 1 );
+        }
+        mBarrier = static_cast<Barrier *>( region );
+        mBarrier->count = 0;
+        mBarrier->generation = 0;
+        mValues = reinterpret_cast<Value *>( mBarrier + 1 );
+    }
+    ~SharedMemoryTransport()
+    {
+        munmap( mBarrier, mSize );
+    }
+    void Attach( int id, Process *process )
+    {
+        mId = id;
+        mProcess = process;
+        if ( id >= 0 )
+            Clear( 0 );
+    }
+    void Send( int source, int destination, const Path &path, const Node &node )
+    {
+        if ( destination == mId ) {
+            mProcess->ReceiveMessage( path, node );
+            return;
+        }
+        if ( node.input_value >= FIRST_INTERNED + mInterned ) {
+            std::cerr << "Value " << ValueTable::Format( node.input_value )
+                      << " was interned after the fork, and can't be shared\n";
+            exit( 1 );
+        }
+        int round = (int) path.size() - 1;
+        size_t index = Process::PathPosition( path, mCursors[ destination ] );
+        Slot( round, source, destination )[ index ] = node.input_value;
+        mBytes += sizeof( Value );
     }
     //
-    // Another somewhat handy utility routine
+    // Waits for everybody to finish writing this round, then reads our slice from
+    // every sender. Then we clear our slots for the next round, which is in the
+    // other buffer. That one held the previous round, and everybody had finished
+    // reading it before they got through this round's barrier.
     //
-    bool IsSource()
+    void Exchange( int round )
     {
-        return mTraits.mSource == mId;
+        Wait();
+        for ( int s = 0 ; s < mN ; s++ ) {
+            if ( s == mId )
+                continue;
+            Process::PathList paths = Process::PathsFor( round, s );
+            const Value *values = Slot( round, s, mId );
+            for ( size_t i = 0 ; i < paths.size() ; i++ )
+                if ( values[ i ] != FAULTY )
+                    mProcess->ReceiveMessage( paths[ i ], Node( values[ i ], UNKNOWN ) );
+        }
+        std::fill( mCursors.begin(), mCursors.end(), 0 );
+        Clear( round + 1 );
+    }
+    size_t Bytes()
+    {
+        return mBytes;
     }
 private :
-    int mId;                    //The integer ID of the process
-    std::map<Path,Node> mNodes; //The map that holds the process tree
-    //
-    // Static data shared among all process objects
+    struct Barrier {
+        volatile uint32_t count;
+        volatile uint32_t generation;
+    };
     //
-    static Traits mTraits;
-    static std::map<Path, std::vector<Path> > mChildren;
-    static std::map<size_t, std::map<size_t, std::vector<Path> > > mPathsByRank;
-    //
-    // This routine calculates the majority value for the children of a given
-    // path. The logic is pretty simple, we increment the count for all possible
-    // values over the children. If there is a clearcut majority, we return that,
-    // otherwise we return the default value defined by the Traits class.
+    // Where the values from sender to destination live in the given round.
     //
-    char GetMajority( const Path &path )
+    Value *Slot( int round, int sender, int destination )
     {
-        std::map<char,size_t> counts;
-        counts[ ONE ] = 0;
-        counts[ ZERO ] = 0;
-        counts[ UNKNOWN ] = 0;
-        size_t n = mChildren[ path ].size();
-        for ( size_t i = 0 ; i < n ; i++ ) {
-            const Path &child = mChildren[ path ][ i ];
-            const Node &node = mNodes[ child ];
-            counts[ node.output_value ]++;
-        }
-        if ( counts[ ONE ] > ( n / 2 ) )
-            return ONE;
-        if ( counts[ ZERO ] > ( n / 2 ) )
-            return ZERO;
-        if ( counts[ ONE ] == counts[ ZERO ] && counts[ ONE ] == ( n /2 ) )
-            return mTraits.GetDefault();
-        return UNKNOWN;
+        Value *values = mValues + ( round % 2 ) * mBufferSize;
+        for ( int s = 0 ; s < sender ; s++ )
+            values += Process::PathsFor( round, s ).size() * mN;
+        return values + Process::PathsFor( round, sender ).size() * destination;
     }
     //
-    // Receiving a message is pretty simple here, it means that some other process
-    // calls this method on the current process with path and a node. All we do
-    // is store the value, we'll use it in the next round of messaging.
+    // Marks all of our slots for the round as not sent yet. This process owns them,
+    // so nobody else is looking.
     //
-    void ReceiveMessage( const Path &path, const Node &node )
+    void Clear( int round )
     {
-        mNodes[ path ] = node;
-    }
-    //
-    // This static method is called by the first process that is constructed. It generates
-    // a static copy of the tree in the mChildren static map. There are many times
-    // in the operation of the algorithm that we have a path and want to find all the
-    // children for that node. By looking up mChildren[ path ] we get a vector
-    // containing all children for that path.
-    //
-    // This recursive routine has some debug output that is useful in debugging. If 
-    // traits object has the debug member set, it will be printed out
-    //
-    static void GenerateChildren( const size_t m, 
-                                  const size_t n,
-                                  std::vector<bool> ids, 
-                                  int source = mTraits.mSource,
-                                  Path current_path = "", 
-                                  size_t rank = 0 )
-    {
-        ids[ source ] = false;
-        current_path += static_cast<char>( source + '0' );
-        mPathsByRank[ rank ][ source ].push_back( current_path );
-        if ( rank < m )
-            for ( int i = 0 ; i < static_cast<int>( ids.size() ) ; i++ )
-                if ( ids[ i ] ) {
-                    GenerateChildren( m, n, ids, i, current_path, rank + 1 );
-                    mChildren[ current_path ].push_back( current_path + static_cast<char>( i + '0' ) );
-                }
-        if ( mTraits.mDebug ) {
-            std::cout << current_path << ", children = ";
-            for ( size_t j = 0 ; j < mChildren[current_path].size() ; j++ )
-                std::cout << mChildren[current_path][ j ] << " ";
-            std::cout << "\n";
+        if ( Process::PathsFor( round, mId ).empty() )
+            return;
+        Value *values = Slot( round, mId, 0 );
+        std::fill( values, values + Process::PathsFor( round, mId ).size() * mN, FAULTY );
+    }
+    void Wait()
+    {
+        uint32_t generation = mBarrier->generation;
+        __sync_synchronize();
+        if ( __sync_add_and_fetch( &mBarrier->count, 1 ) == (uint32_t) mN ) {
+            mBarrier->count = 0;
+            __sync_add_and_fetch( &mBarrier->generation, 1 );
+            syscall( SYS_futex, &mBarrier->generation, FUTEX_WAKE, INT_MAX, 0, 0, 0 );
+        } else {
+            while ( mBarrier->generation == generation )
+                syscall( SYS_futex, &mBarrier->generation, FUTEX_WAIT, generation, 0, 0, 0 );
+        }
+        __sync_synchronize();
+    }
+    int mN;
+    int mId;
+    Process *mProcess;
+    size_t mInterned;               //Values interned before this point can be shared
+    Barrier *mBarrier;              //The start of the shared mapping
+    Value *mValues;                 //The two message buffers, right after the barrier
+    size_t mBufferSize;             //The number of values in each buffer
+    size_t mSize;                   //The size of the whole mapping in bytes
+    std::vector<size_t> mCursors;   //Where the last message for each destination was found
+    size_t mBytes;
+};
+#endif
+
+//
+// Runs one agreement with every process in its own OS process. The parent forks
+// the children, each child runs all the rounds for its own process and then writes
+// its decision back up a pipe, and the parent prints the results along with the
+// wall clock time it took.
+//
+void RunSeparateProcesses( int n, int m, PeerTransport &transport )
+{
+    timeval start;
+    gettimeofday( &start, 0 );
+    std::vector<Process> processes;
+    for ( int i = 0 ; i < n ; i++ )
+        processes.push_back( Process( i ) );
+    size_t bytes = 0;
+    std::vector<int> results( n );
+    std::vector<pid_t> children( n );
+    for ( int i = 0 ; i < n ; i++ ) {
+        int pipe_fds[ 2 ];
+        if ( pipe( pipe_fds ) < 0 ) {
+            perror( "pipe" );
+            exit( 1 );
+        }
+        std::cout.flush();
+        children[ i ] = fork();
+        if ( children[ i ] < 0 ) {
+            perror( "fork" );
+            exit( 1 );
         }
+        if ( children[ i ] == 0 ) {
+            close( pipe_fds[ 0 ] );
+            transport.Attach( i, &processes[ i ] );
+            for ( int round = 0 ; round <= m ; round++ ) {
+                processes[ i ].SendMessages( round, transport );
+                transport.Exchange( round );
+            }
+            std::string result;
+            Wire::PutValue( result, processes[ i ].IsFaulty() ? FAULTY : processes[ i ].Decide() );
+            Wire::PutVarint( result, transport.Bytes() );
+            if ( write( pipe_fds[ 1 ], result.data(), result.size() ) != (ssize_t) result.size() )
+                _exit( 1 );
+            _exit( 0 );
+        }
+        close( pipe_fds[ 1 ] );
+        results[ i ] = pipe_fds[ 0 ];
+    }
+    transport.Attach( -1, 0 );
+    for ( int i = 0 ; i < n ; i++ ) {
+        std::string result;
+        char buffer[ 4096 ];
+        ssize_t count;
+        while ( ( count = read( results[ i ], buffer, sizeof( buffer ) ) ) > 0 )
+            result.append( buffer, count );
+        close( results[ i ] );
+        waitpid( children[ i ], 0, 0 );
+        if ( processes[ i ].IsSource() )
+            std::cout << "Source ";
+        std::cout << "Process " << i << " (pid " << children[ i ] << ")";
+        if ( result.empty() )
+            std::cout << " failed\n";
+        else {
+            const char *p = result.data();
+            Value value = Wire::GetValue( p );
+            bytes += Wire::GetVarint( p );
+            if ( processes[ i ].IsFaulty() )
+                std::cout << " is faulty\n";
+            else
+                std::cout << " decides on value " << ValueTable::Format( value ) << "\n";
+        }
+    }
+    timeval finish;
+    gettimeofday( &finish, 0 );
+    std::cout << "Separate processes took "
+              << ( finish.tv_sec - start.tv_sec ) * 1000000 + ( finish.tv_usec - start.tv_usec )
+              << " microseconds and wrote " << bytes << " bytes\n\n";
+}
+
+//
+// Explores every combination of strategies for the faulty relay, from the given
+// round on. Scenarios that only differ from round k on have the same first k
+// rounds, so rather than running each one from the start, we run the shared rounds
+// once and fork() at every branch point, once per strategy. The child carries on
+// with the next round under that strategy, and the kernel's copy-on-write pages
+// mean the snapshot of all the trees costs next to nothing until the child starts
+// changing them. Each child waits for its own children before it exits, and the
+// parent waits for each child before forking the next, so the output comes out in
+// order.
+//
+// Returns the number of rounds this branch and its children ran.
+//
+size_t ExploreScenarios( std::vector<Process> &processes, int round, int m, int branch, std::string &label )
+{
+    static const char names[] = "LEIS";
+    if ( round > m ) {
+        std::cout << "Scenario " << ( label.empty() ? "-" : label.c_str() );
+        Value value = UNKNOWN;
+        bool agreed = true;
+        for ( size_t j = 0 ; j < processes.size() ; j++ ) {
+            if ( processes[ j ].IsFaulty() )
+                continue;
+            Value decision = processes[ j ].Decide();
+            if ( value != UNKNOWN && decision != value )
+                agreed = false;
+            value = decision;
+        }
+        std::cout << ( agreed ? " decides on value " : " disagrees, last value " )
+                  << ValueTable::Format( value ) << "\n";
+        return 0;
+    }
+    if ( round < branch ) {
+        for ( size_t j = 0 ; j < processes.size() ; j++ )
+            processes[ j ].SendMessages( round, processes );
+        return 1 + ExploreScenarios( processes, round + 1, m, branch, label );
+    }
+    size_t rounds = 0;
+    for ( int strategy = Traits::LIE ; strategy <= Traits::SPLIT ; strategy++ ) {
+        int fds[ 2 ];
+        std::cout.flush();
+        if ( pipe( fds ) < 0 ) {
+            perror( "pipe" );
+            exit( 1 );
+        }
+        pid_t pid = fork();
+        if ( pid < 0 ) {
+            perror( "fork" );
+            exit( 1 );
+        }
+        if ( pid == 0 ) {
+            close( fds[ 0 ] );
+            label += names[ strategy ];
+            Process::SetStrategy( round, (Traits::Strategy) strategy );
+            for ( size_t j = 0 ; j < processes.size() ; j++ )
+                processes[ j ].SendMessages( round, processes );
+            std::string out;
+            Wire::PutVarint( out, 1 + ExploreScenarios( processes, round + 1, m, branch, label ) );
+            std::cout.flush();
+            if ( write( fds[ 1 ], out.data(), out.size() ) < 0 )
+                perror( "write" );
+            _exit( 0 );
+        }
+        close( fds[ 1 ] );
+        char buffer[ 16 ];
+        ssize_t n = read( fds[ 0 ], buffer, sizeof( buffer ) );
+        close( fds[ 0 ] );
+        waitpid( pid, 0, 0 );
+        const char *p = buffer;
+        if ( n > 0 )
+            rounds += Wire::GetVarint( p );
+    }
+    return rounds;
+}
+
+//
+// Rebuilds one process from a trace recorded in an earlier run, without running
+// anything else, and has it decide. The trace has to be for the given N, M and
+// source, which are the ones this was built with. With the dump flag set, the rebuilt tree is written
+// out as text as well, for a post mortem.
+//
+// Returns the exit status for main().
+//
+int ReplayOnly( const char *file, int id, int n, int m, int source, bool dump )
+{
+    if ( id < 0 || id >= n ) {
+        std::cerr << "There is no process " << id << " to replay\n";
+        return 1;
+    }
+    timeval start;
+    timeval end;
+    gettimeofday( &start, 0 );
+    TraceReplay replay( file );
+    Process process( id );
+    if ( !replay.Replay( id, process, n, m, source ) ) {
+        std::cerr << file << " was recorded for a different topology\n";
+        return 1;
+    }
+    Value value = process.Decide();
+    gettimeofday( &end, 0 );
+    std::cout << "Replayed " << replay.Count() << " records from " << file
+              << ( replay.IsComplete() ? "" : " (wrapped, so part of the run is missing)" )
+              << ", process " << id << " decides on value " << ValueTable::Format( value ) << " in "
+              << ( end.tv_sec - start.tv_sec ) * 1000000 + end.tv_usec - start.tv_usec << " microseconds\n";
+    if ( dump ) {
+        std::cout.flush();
+        TreeWriter( STDOUT_FILENO, TreeWriter::TEXT ).Write( process, id );
+    }
+    return 0;
+}
+
+//
+// Runs the agreement again from a StaticTopology, and checks it against the usual
+// run. The tables are worked out when this is instantiated, which can take the
+// compiler a while, and is refused for large shapes, so it must not happen unless
+// STATIC_TOPOLOGY is set. That's why this is a template on the flag rather than
+// an if in main(): with the flag off, only the empty version below is ever used.
+//
+template <bool enabled, int n, int m, int source>
+struct StaticTopologyRun {
+    static void Run( std::vector<Process> & )
+    {
+        if ( enabled )
+            std::cout << "Static topology: the tables need a C++11 compiler\n";
+    }
+};
+
+#if __cplusplus >= 201103L
+template <int n, int m, int source>
+struct StaticTopologyRun<true, n, m, source> {
+    static void Run( std::vector<Process> &processes )
+    {
+        typedef StaticTopology<n, m, source> Topology;
+        SharedNodeStore store( n, Topology::NODES );
+        for ( int i = 0 ; i <= m ; i++ )
+            Process::SendStatic<Topology>( i, store );
+        int matched = 0;
+        for ( int j = 0 ; j < n ; j++ )
+            if ( processes[ j ].IsFaulty() || Process::DecideStatic<Topology>( j, store ) == processes[ j ].Decide() )
+                matched++;
+        std::cout << "Static topology: " << matched << " of " << n << " processes decide the same way, from tables of "
+                  << Topology::NODES << " nodes\n";
     }
 };
+#endif
 
 //
 // Parameters used to characterize the Traits class. Tinker with these at will!
@@ -415,30 +4581,306 @@ const int N = 7;
 const int M = 2;
 const int SOURCE = 3;
 const bool DEBUG = false;
+//
+// Set this to stop sending messages for parts of the tree that every loyal process
+// already agrees on, and to stop altogether once the decision itself is settled.
+//
+const bool EARLY_STOPPING = false;
+//
+// Set this to have each process look for processes that have been caught lying to it
+// after each round, and to ignore what they send from then on. Every process acts on
+// its own findings only, since it has no way to prove them to anyone else.
+//
+const bool FAULT_DETECTION = false;
+//
+// Set this to agree on 64-bit batch IDs instead of a single bit.
+//
+const bool MULTI_VALUED = false;
+//
+// Set this to the number of independent flags to agree on in a single pass of
+// vector consensus, or zero for a single value.
+//
+const size_t VECTOR_BITS = 0;
+//
+// Set this to run that many more agreements back to back through the Pipeline,
+// after the usual single run.
+//
+const int PIPELINE_INSTANCES = 0;
+//
+// Set this to run interactive consistency after the usual run, with every general
+// a source, and report the vector each loyal process agrees on.
+//
+const bool INTERACTIVE_CONSISTENCY = false;
+//
+// Set this to send the messages of the usual run over a simulated network, and
+// report when each round completes. The link model below applies to every link;
+// use NetworkSimulator::SetLink() to describe a more interesting topology.
+//
+const bool SIMULATE_NETWORK = false;
+const NetworkSimulator::Link LINK( 40.0, 10.0, NetworkSimulator::EXPONENTIAL, 1250.0 );
+//
+// With a simulated network, set this to a positive number of milliseconds to give
+// each round a deadline instead of waiting for every message. That's the timeout
+// for the first round; after that it adapts to the latencies seen so far. Messages
+// that miss the deadline are taken to be UNKNOWN, or the default value if the
+// second flag is set. This turns FAULT_DETECTION off.
+//
+const double ROUND_TIMEOUT = 0;
+const bool TIMEOUT_DEFAULTS = false;
+//
+// Set this to have each process resolve its tree as messages arrive, and report
+// how early its decision was fixed. It only covers the plain protocol, so it is
+// turned off with EARLY_STOPPING or FAULT_DETECTION.
+//
+const bool INCREMENTAL_DECIDE = false;
+//
+// Set this to also decide top-down, skipping subtrees that can't change the
+// majority, and report how much of the tree that visited.
+//
+const bool SATURATION_BOUNDS = false;
+//
+// Set this to the name of a file to record every message of the run into it. The
+// trace is then replayed to check it.
+//
+const char *const TRACE_FILE = 0;
+//
+// Set this to the name of a trace from an earlier run to do nothing but replay it:
+// the given process is rebuilt from the messages it got and decides. With DEBUG on,
+// its tree is dumped too.
+//
+const char *const REPLAY_FILE = 0;
+const int REPLAY_PROCESS = 0;
+//
+// Set this to also have every process decide with the depth-first engine, which
+// uses next to no memory.
+//
+const bool DEPTH_FIRST = false;
+//
+// Set this to keep the trees of all the processes in a copy-on-write store, and see
+// how many nodes they share. It doesn't go with FAULT_DETECTION, and it turns
+// INCREMENTAL_DECIDE off.
+//
+const bool SHARED_STORE = false;
+//
+// Set this to keep the trees of all the processes as the ways they differ from an
+// honest run, and see how many nodes that is. It has the same limits as the shared
+// store, and the shared store wins if both are set.
+//
+const bool DELTA_STORE = false;
+//
+// Set this to have Decide() reuse the majority of any subtree whose contents it has
+// seen before, in any process, and report the hit rate. It doesn't go with WHAT_IF.
+//
+const bool MEMOIZE_SUBTREES = false;
+//
+// Set this to try changing each leaf of one process, and see which ones matter.
+// It needs the whole tree, so it doesn't go with INCREMENTAL_DECIDE.
+//
+const bool WHAT_IF = false;
+//
+// Set this to run the agreement again with the topology taken from tables that
+// the compiler built for this N, M and SOURCE. It needs C++11.
+//
+const bool STATIC_TOPOLOGY = false;
+//
+// Set this to a round number to run every combination of strategies for the faulty
+// relay from that round on, sharing the rounds before it.
+//
+const int BRANCH_ROUND = -1;
+//
+// Set this to a positive number to build the whole topology up front with that many
+// threads, and report how long it took.
+//
+const int TOPOLOGY_THREADS = 0;
+//
+// Set this to run the agreement again after the usual run, with each general in its
+// own OS process, exchanging messages over Unix domain sockets.
+//
+const bool SEPARATE_PROCESSES = false;
+//
+// Set this to send messages between separate processes in the compact encoding,
+// where paths are implied by their position. Turn it off to send every path.
+//
+const bool COMPACT_WIRE = true;
+//
+// Set this to have the separate processes write their messages into shared memory
+// instead of sending them over sockets. This needs Linux.
+//
+const bool SHARED_MEMORY = false;
+//
+// The format of the dumps the user asks for at the end, see TreeWriter. A BINARY
+// dump goes to process<ID>.byzt, and is read back to check it.
+//
+const TreeWriter::Format DUMP_FORMAT = TreeWriter::DOT;
+//
+// Set this to a positive number to run that many independent agreements at once,
+// each process a resumable task on a single-threaded executor.
+//
+const int TASK_INSTANCES = 0;
+
+//
+// The interned payloads. These have to be defined ahead of the Traits object,
+// which interns its values when it is constructed.
+//
+std::vector<std::string> ValueTable::mPayloads;
+std::vector<size_t> ValueTable::mBits;
+std::map<std::pair<size_t, std::string>, Value> ValueTable::mIndex;
 
 //
-// The definition of the three static members used by the Process class
+// The definition of the static members used by the Process class
 //
-std::map<Path, std::vector<Path> > Process::mChildren;
-std::map<size_t, std::map<size_t, std::vector<Path> > >  Process::mPathsByRank;
-Traits Process::mTraits = Traits( SOURCE, M, N, DEBUG );
+std::vector<Process::LevelData> Process::mLevels( M + 1 );
+Traits Process::mTraits = Traits( SOURCE, M, N, DEBUG, MULTI_VALUED, VECTOR_BITS );
+PathIndex Process::mIndex( N, M );
+bool Process::mMemoize = false;
+std::map<std::pair<int, uint64_t>, Value> Process::mMemo;
+size_t Process::mMemoHits = 0;
+size_t Process::mMemoMisses = 0;
 
 int main()
 {
+    if ( REPLAY_FILE )
+        return ReplayOnly( REPLAY_FILE, REPLAY_PROCESS, N, M, SOURCE, DEBUG );
+    //
+    // Normally the topology is generated a level at a time as the rounds need it,
+    // but it can be built all at once, in parallel.
+    //
+    if ( TOPOLOGY_THREADS > 0 ) {
+        timeval start;
+        timeval end;
+        gettimeofday( &start, 0 );
+        Process::BuildTopology( TOPOLOGY_THREADS );
+        gettimeofday( &end, 0 );
+        std::cout << "Built the topology of " << Process::NodeCount() << " nodes with " << TOPOLOGY_THREADS
+                  << " threads in " << ( end.tv_sec - start.tv_sec ) * 1000000 + end.tv_usec - start.tv_usec
+                  << " microseconds\n";
+    }
     //
     // Create the message tree
     //
+    if ( MEMOIZE_SUBTREES && WHAT_IF )
+        std::cout << "Subtree memo is off, since the what-if run needs every output\n";
+    else
+        Process::SetMemoize( MEMOIZE_SUBTREES );
+    bool incremental = INCREMENTAL_DECIDE;
+    if ( incremental && ( EARLY_STOPPING || FAULT_DETECTION ) ) {
+        std::cout << "Incremental deciding is off, since it only covers the plain protocol\n";
+        incremental = false;
+    }
+    bool stored = SHARED_STORE || DELTA_STORE;
+    if ( stored && FAULT_DETECTION ) {
+        std::cout << "The node stores are off, since ignored messages would read as stored ones\n";
+        stored = false;
+    } else if ( SHARED_STORE && DELTA_STORE )
+        std::cout << "Delta store is off, since the trees are in the shared store\n";
+    if ( incremental && stored ) {
+        std::cout << "Incremental deciding is off, since it needs a tree of its own\n";
+        incremental = false;
+    }
     std::vector<Process> processes;
-    for ( int i = 0 ; i < N ; i++ )
+    for ( int i = 0 ; i < N ; i++ ) {
         processes.push_back( Process( i ) );
+        processes.back().SetIncremental( incremental );
+    }
+    //
+    // The trees can go in a store instead of the processes. The delta store's baseline
+    // is what the source proposes, which only the source process knows.
+    //
+    SharedNodeStore *shared = 0;
+    DeltaNodeStore *delta = 0;
+    NodeStore *store = 0;
+    if ( stored && SHARED_STORE )
+        store = shared = new SharedNodeStore( N, Process::NodeCount() );
+    else if ( stored )
+        store = delta = new DeltaNodeStore( N, processes[ SOURCE ].Decide() );
+    for ( int i = 0 ; i < N ; i++ )
+        processes[ i ].SetStore( store );
     //
     // Starting at round 0 and working up to round M, call the
     // SendMessages() method of each process. It will send the appropriate
     // message to all other sibling processes.
     //
+    // With early stopping turned on, after each round every process sends out claims
+    // for the nodes it found to be settled, and then weighs the claims it got. They go
+    // through the same transport as the messages, and are counted the same way. Once
+    // a round goes by with nothing left to send, the remaining ones are skipped.
+    //
+    // With fault detection turned on, each process checks after each round whether
+    // anyone has been caught lying to it, and ignores them from then on. Nothing is
+    // shared: every process acts on its own findings only.
+    //
+    // A level of the topology is freed once no round needs it any more: the one
+    // before the last round, since fault detection looks at a round's parents, or
+    // none with early stopping, which looks back at all of them. Deciding needs no
+    // topology, so the rest go after the last round. Whatever runs after that makes
+    // the levels it needs again.
+    //
+    size_t sent = 0;
+    size_t claims = 0;
+    size_t total = 0;
+    int last_round = M;
+    NetworkSimulator network( processes, LINK );
+    RoundTimer timer( ROUND_TIMEOUT );
+    Process::DirectTransport direct( processes );
+    Transport *transport = &direct;
+    if ( SIMULATE_NETWORK )
+        transport = &network;
+    bool detect_faults = FAULT_DETECTION;
+    if ( detect_faults && SIMULATE_NETWORK && ROUND_TIMEOUT > 0 ) {
+        std::cout << "Fault detection is off, since a loyal process that misses a deadline looks faulty\n";
+        detect_faults = false;
+    }
+    TraceRecorder *recorder = 0;
+    if ( TRACE_FILE ) {
+        uint32_t flags = ( EARLY_STOPPING ? TraceRecorder::SETTLE_CLAIMS : 0 )
+                       | ( detect_faults ? TraceRecorder::FIND_FAULTY : 0 );
+        recorder = new TraceRecorder( TRACE_FILE, *transport, N, M, SOURCE, flags );
+        transport = recorder;
+        if ( SIMULATE_NETWORK )
+            network.SetObserver( recorder );
+    }
     for ( int i = 0 ; i <= M ; i++ )
+        total += Process::MessageCount( i );
+    for ( int i = 0 ; i <= M ; i++ ) {
+        size_t before = sent;
         for ( int j = 0 ; j < N ; j++ )
-            processes[ j ].SendMessages( i, processes );
+            sent += processes[ j ].SendMessages( i, *transport );
+        if ( sent == before ) {
+            last_round = i - 1;
+            break;
+        }
+        if ( SIMULATE_NETWORK && ROUND_TIMEOUT > 0 ) {
+            double timeout = timer.Timeout();
+            Value substitute = TIMEOUT_DEFAULTS ? Process::DefaultValue() : UNKNOWN;
+            std::cout << "Round " << i << " with a timeout of " << timeout << " ms completes at "
+                      << network.RunRound( timeout, substitute ) << " ms, "
+                      << network.Late() << " messages late so far\n";
+            timer.Observe( network.Latencies() );
+        } else if ( SIMULATE_NETWORK )
+            std::cout << "Round " << i << " completes at " << network.RunRound() << " ms, "
+                      << network.Bytes() << " bytes sent so far\n";
+        if ( store )
+            store->Flush();
+        if ( detect_faults && i < M )
+            for ( int j = 0 ; j < N ; j++ )
+                if ( processes[ j ].FindFaulty( i ) && !processes[ j ].IsFaulty() )
+                    for ( int k = 0 ; k < N ; k++ )
+                        if ( processes[ j ].Suspects( k ) )
+                            std::cout << "Process " << j << " suspects process " << k
+                                      << " after round " << i << "\n";
+        if ( EARLY_STOPPING && i < M ) {
+            for ( int j = 0 ; j < N ; j++ )
+                claims += processes[ j ].FindSettled( i, *transport );
+            if ( SIMULATE_NETWORK )
+                network.RunRound();
+            for ( int j = 0 ; j < N ; j++ )
+                processes[ j ].AdoptSettled( i );
+        }
+        if ( !EARLY_STOPPING && i > 0 )
+            Process::ReleaseLevel( i - 1 );
+    }
+    for ( int i = 0 ; i <= M ; i++ )
+        Process::ReleaseLevel( i );
     //
     // All that is left is to print out the results. For non-faulty processes,
     // we call the Decide() method to see what what the process decision was
@@ -447,13 +4889,231 @@ int main()
         if ( processes[ j ].IsSource() )
             std::cout << "Source ";
         std::cout << "Process " << j;
-        if ( !processes[ j ].IsFaulty() )
-            std::cout << " decides on value " << processes[ j ].Decide();
-        else
+        if ( !processes[ j ].IsFaulty() ) {
+            std::cout << " decides on value " << ValueTable::Format( processes[ j ].Decide() );
+            if ( EARLY_STOPPING && processes[ j ].EarlyRound() >= 0 )
+                std::cout << " after round " << processes[ j ].EarlyRound();
+            if ( incremental && !processes[ j ].IsSource() )
+                std::cout << ", incrementally " << ValueTable::Format( processes[ j ].Decision() )
+                          << " after " << processes[ j ].FixedAfter()
+                          << " of " << processes[ j ].Received() << " messages, "
+                          << processes[ j ].Discarded() << " dropped";
+            if ( SATURATION_BOUNDS && !processes[ j ].IsSource() ) {
+                Value value = processes[ j ].DecideBounded();
+                std::cout << ", bounded " << ValueTable::Format( value )
+                          << " visiting " << processes[ j ].Visited()
+                          << " of " << Process::NodeCount() << " nodes";
+            }
+            if ( DEPTH_FIRST )
+                std::cout << ", depth first " << ValueTable::Format( Process::DecideDepthFirst( j ) );
+            if ( detect_faults && processes[ j ].Ignored() )
+                std::cout << ", ignored " << processes[ j ].Ignored() << " messages";
+        } else
             std::cout << " is faulty";
         std::cout << "\n";
     }
+    if ( EARLY_STOPPING || FAULT_DETECTION ) {
+        std::cout << "Stopped after round " << last_round << " of " << M
+                  << ", sent " << sent << " of " << total << " messages";
+        if ( EARLY_STOPPING )
+            std::cout << " and " << claims << " settle claims";
+        std::cout << "\n";
+    }
+    //
+    // The what-if run knocks out one leaf at a time in the first loyal lieutenant,
+    // making it UNKNOWN, and counts how many of those would change the decision.
+    //
+    if ( WHAT_IF && incremental )
+        std::cout << "What-if: needs the whole tree, which incremental deciding doesn't keep\n";
+    else if ( WHAT_IF ) {
+        int j = 0;
+        while ( processes[ j ].IsFaulty() )
+            j++;
+        Process &process = processes[ j ];
+        Value decision = process.Decide();
+        size_t probes = 0;
+        size_t changes = 0;
+        size_t skipped = 0;
+        timeval start;
+        timeval end;
+        gettimeofday( &start, 0 );
+        for ( int s = 0 ; s < N ; s++ )
+            for ( size_t i = 0 ; i < Process::PathsFor( M, s ).size() ; i++ ) {
+                const Path &path = Process::PathsFor( M, s )[ i ];
+                Node node;
+                Value value = process.FindNode( path, node ) ? node.input_value : UNKNOWN;
+                Value changed;
+                if ( !process.WhatIf( path, UNKNOWN, changed ) ) {
+                    skipped++;
+                    continue;
+                }
+                if ( changed != decision )
+                    changes++;
+                process.WhatIf( path, value, changed );
+                probes++;
+            }
+        gettimeofday( &end, 0 );
+        std::cout << "What-if: " << changes << " of " << probes << " single leaves change the decision of process "
+                  << j << ", in " << ( end.tv_sec - start.tv_sec ) * 1000000 + end.tv_usec - start.tv_usec
+                  << " microseconds";
+        if ( skipped )
+            std::cout << ", " << skipped << " leaves pruned or never received";
+        std::cout << "\n";
+    }
+    //
+    // With the trees in the shared store, report how much of them the processes
+    // shared, and how many subtrees they found decided by somebody else.
+    //
+    if ( shared ) {
+        std::cout << "Shared store: using " << shared->Chunks() << " chunks instead of " << shared->Unshared()
+                  << ", with " << shared->Hits() << " of " << shared->Hits() + shared->Misses()
+                  << " subtrees decided already\n";
+    }
+    //
+    // The static topology runs the plain protocol in a shared store, with no paths.
+    // It's only built when it's asked for, see StaticTopologyRun.
+    //
+    StaticTopologyRun<STATIC_TOPOLOGY, N, M, SOURCE>::Run( processes );
+    //
+    // The memo counts cover every Decide() so far
+    //
+    if ( MEMOIZE_SUBTREES && !WHAT_IF )
+        std::cout << "Subtree memo: " << Process::MemoHits() << " of "
+                  << Process::MemoHits() + Process::MemoMisses() << " majorities found already\n";
+    //
+    // The delta store only keeps what differs from an honest run, see how much that is
+    //
+    if ( delta )
+        std::cout << "Delta store: storing " << delta->Entries() << " nodes instead of "
+                  << N * Process::NodeCount() << "\n";
+    //
+    // With a trace, close it and check that replaying it into fresh processes gets
+    // every process the same tree, and every loyal process to the same decision. Turn
+    // on SIMULATE_NETWORK and ROUND_TIMEOUT as well to check the late messages. The
+    // trees aren't compared with incremental deciding, which drops leaves in the run.
+    //
+    if ( recorder ) {
+        network.SetObserver( 0 );
+        delete recorder;
+        TraceReplay replay( TRACE_FILE );
+        int matched = 0;
+        int trees = 0;
+        for ( int j = 0 ; j < N ; j++ ) {
+            Process process( j );
+            if ( !replay.Replay( j, process, N, M, SOURCE ) )
+                continue;
+            if ( !incremental && process.SameInputs( processes[ j ] ) )
+                trees++;
+            if ( processes[ j ].IsFaulty() || process.Decide() == processes[ j ].Decide() )
+                matched++;
+        }
+        std::cout << "Replayed " << replay.Count() << " records from " << TRACE_FILE
+                  << ( replay.IsComplete() ? "" : " (wrapped)" ) << ", ";
+        if ( !incremental )
+            std::cout << trees << " of " << N << " processes have the same tree, ";
+        std::cout << matched << " of " << N << " decide the same way\n";
+    }
     std::cout << "\n";
+    //
+    // The pipelined run reports one line per instance, checking that all the loyal
+    // processes agree, followed by the throughput.
+    //
+    if ( PIPELINE_INSTANCES > 0 ) {
+        Pipeline pipeline( N, M );
+        int rounds = pipeline.Run( PIPELINE_INSTANCES );
+        for ( int k = 0 ; k < PIPELINE_INSTANCES ; k++ ) {
+            Value value = UNKNOWN;
+            bool agreed = true;
+            for ( int j = 0 ; j < N ; j++ ) {
+                Value decision = pipeline.mDecisions[ k ][ j ];
+                if ( processes[ j ].IsFaulty() )
+                    continue;
+                if ( value != UNKNOWN && decision != value )
+                    agreed = false;
+                value = decision;
+            }
+            std::cout << "Instance " << k
+                      << ( agreed ? " decides on value " : " disagrees, last value " )
+                      << ValueTable::Format( value ) << "\n";
+        }
+        std::cout << "Pipelined " << PIPELINE_INSTANCES << " instances in " << rounds
+                  << " rounds, " << (double) PIPELINE_INSTANCES / rounds
+                  << " decisions per round instead of " << 1.0 / ( M + 1 ) << "\n\n";
+    }
+    //
+    // Interactive consistency prints the vector each loyal process ends up with,
+    // and how many batches all the messages went in.
+    //
+    if ( INTERACTIVE_CONSISTENCY ) {
+        InteractiveConsistency consistency( N, M, SOURCE );
+        consistency.Run();
+        for ( int j = 0 ; j < N ; j++ ) {
+            if ( processes[ j ].IsFaulty() )
+                continue;
+            std::vector<Value> values = consistency.Decide( j );
+            std::cout << "Process " << j << " agrees on";
+            for ( int s = 0 ; s < N ; s++ )
+                std::cout << " " << ValueTable::Format( values[ s ] );
+            std::cout << "\n";
+        }
+        std::cout << "Interactive consistency: " << N << " instances, " << consistency.Messages()
+                  << " messages in " << consistency.Batches() << " batches\n\n";
+    }
+    //
+    // The task-based run just reports how many of the instances reached agreement,
+    // since there can be a lot of them.
+    //
+    if ( TASK_INSTANCES > 0 ) {
+        Executor executor( N, M, TASK_INSTANCES, EARLY_STOPPING );
+        executor.Run();
+        int agreed = 0;
+        for ( int k = 0 ; k < TASK_INSTANCES ; k++ ) {
+            Value value = UNKNOWN;
+            bool agreement = true;
+            for ( int j = 0 ; j < N ; j++ ) {
+                Value decision = executor.mDecisions[ k ][ j ];
+                if ( processes[ j ].IsFaulty() )
+                    continue;
+                if ( value != UNKNOWN && decision != value )
+                    agreement = false;
+                value = decision;
+            }
+            if ( agreement )
+                agreed++;
+        }
+        std::cout << "Ran " << TASK_INSTANCES << " instances as " << TASK_INSTANCES * N
+                  << " tasks in " << executor.Resumptions() << " resumptions, ";
+        if ( EARLY_STOPPING )
+            std::cout << "with " << executor.Claims() << " settle claims, ";
+        std::cout << agreed << " reached agreement\n\n";
+    }
+    //
+    // The scenario sweep prints one line per scenario, labelled with the strategy
+    // used in each round from the branch point on: Lie, Echo, Invert or Split.
+    //
+    if ( BRANCH_ROUND >= 0 ) {
+        std::vector<Process> fresh;
+        for ( int j = 0 ; j < N ; j++ )
+            fresh.push_back( Process( j ) );
+        std::string label;
+        size_t rounds = ExploreScenarios( fresh, 0, M, BRANCH_ROUND, label );
+        size_t scenarios = 1;
+        for ( int i = BRANCH_ROUND ; i <= M ; i++ )
+            scenarios *= Traits::SPLIT + 1;
+        std::cout << "Explored " << scenarios << " scenarios in " << rounds << " rounds instead of "
+                  << scenarios * ( M + 1 ) << "\n\n";
+    }
+    if ( SEPARATE_PROCESSES && SHARED_MEMORY ) {
+#ifdef __linux__
+        SharedMemoryTransport transport( N, M );
+        RunSeparateProcesses( N, M, transport );
+#else
+        std::cout << "Shared memory: the barrier is a futex, which needs Linux\n\n";
+#endif
+    } else if ( SEPARATE_PROCESSES ) {
+        SocketTransport transport( N, COMPACT_WIRE );
+        RunSeparateProcesses( N, M, transport );
+    }
     for ( ; ; ) {
         std::string s;
         std::cout << "ID of process to dump, or enter to quit: ";
@@ -465,13 +5125,40 @@ int main()
         s1 >> id;
         //
         // If Debug mode is turned on, we do a normal dump ahead of the DOT format
-        // dump.
+        // dump. The writers go straight to the file descriptor, so cout has to be
+        // flushed before and after.
+        //
+        // A binary dump goes to a file instead, which is read back to check it.
         //
-        if ( DEBUG ) {
-            std::cout << processes[ id ].Dump() << "\n";
+        std::cout.flush();
+        if ( DEBUG && DUMP_FORMAT != TreeWriter::TEXT ) {
+            TreeWriter( STDOUT_FILENO, TreeWriter::TEXT ).Write( processes[ id ], id );
+            std::cout << "\n";
             getline( std::cin, s );
         }
-        std::cout << processes[ id ].DumpDot() << "\n";
+        if ( DUMP_FORMAT == TreeWriter::BINARY ) {
+            std::stringstream name;
+            name << "process" << id << ".byzt";
+            int fd = open( name.str().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+            if ( fd < 0 ) {
+                perror( name.str().c_str() );
+                continue;
+            }
+            TreeWriter( fd, TreeWriter::BINARY ).Write( processes[ id ], id );
+            lseek( fd, 0, SEEK_SET );
+            TreeReader reader;
+            bool read = reader.Read( fd );
+            close( fd );
+            std::cout << "Wrote " << Process::NodeCount() << " nodes to " << name.str();
+            if ( read && reader.Id() == id && reader.Matches( processes[ id ] ) )
+                std::cout << ", and read back the same tree\n";
+            else
+                std::cout << ", but reading it back gave a different tree\n";
+            continue;
+        }
+        TreeWriter( STDOUT_FILENO, DUMP_FORMAT ).Write( processes[ id ], id );
+        std::cout << "\n";
     }
+    delete store;
     return 0;
 }